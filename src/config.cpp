@@ -70,6 +70,21 @@ bool Config::Read(const std::string &path)
 		Config::keyboardFontSize = std::stoi(Config::options["keyboard-font-size"]);
 	}
 
+	it = Config::options.find("keyboard-render-threads");
+	if (it != Config::options.end()) {
+		Config::keyboardRenderThreads = std::stoi(Config::options["keyboard-render-threads"]);
+	}
+
+	it = Config::options.find("keyboard-cache");
+	if (it != Config::options.end()) {
+		Config::keyboardCache = Config::options["keyboard-cache"];
+	}
+
+	it = Config::options.find("keyboard-renderer");
+	if (it != Config::options.end()) {
+		Config::keyboardAtlas = (Config::options["keyboard-renderer"] == "atlas");
+	}
+
 	it = Config::options.find("keyboard-map");
 	if (it != Config::options.end()) {
 		Config::keyboardMap = Config::options["keyboard-map"];
@@ -174,6 +189,92 @@ bool Config::Read(const std::string &path)
 		/* Disable animations when using Directfb */
 		Config::animations = Config::animations && !isDirectFB();
 	}
+
+	it = Config::options.find("kdf-priority");
+	if (it != Config::options.end()) {
+		Config::kdfPriority = (Config::options["kdf-priority"] == "true");
+	}
+
+	it = Config::options.find("cpufreq-boost");
+	if (it != Config::options.end()) {
+		Config::cpufreqBoost = (Config::options["cpufreq-boost"] == "true");
+	}
+
+	it = Config::options.find("cpufreq-sysfs-root");
+	if (it != Config::options.end()) {
+		Config::cpufreqSysfsRoot = Config::options["cpufreq-sysfs-root"];
+	}
+
+	it = Config::options.find("evdev-devices");
+	if (it != Config::options.end()) {
+		Config::evdevDevices = Config::options["evdev-devices"];
+	}
+
+	it = Config::options.find("keyslot-cache");
+	if (it != Config::options.end()) {
+		Config::keyslotCache = Config::options["keyslot-cache"];
+	}
+
+	it = Config::options.find("keyslot-parallel");
+	if (it != Config::options.end()) {
+		Config::keyslotParallel = (Config::options["keyslot-parallel"] == "true");
+	}
+
+	it = Config::options.find("crypt-allow-discards");
+	if (it != Config::options.end()) {
+		Config::cryptAllowDiscards = (Config::options["crypt-allow-discards"] == "true");
+	}
+
+	it = Config::options.find("crypt-same-cpu-crypt");
+	if (it != Config::options.end()) {
+		Config::cryptSameCpuCrypt = (Config::options["crypt-same-cpu-crypt"] == "true");
+	}
+
+	it = Config::options.find("crypt-submit-from-crypt-cpus");
+	if (it != Config::options.end()) {
+		Config::cryptSubmitFromCryptCpus = (Config::options["crypt-submit-from-crypt-cpus"] == "true");
+	}
+
+	it = Config::options.find("crypt-no-read-workqueue");
+	if (it != Config::options.end()) {
+		Config::cryptNoReadWorkqueue = (Config::options["crypt-no-read-workqueue"] == "true");
+	}
+
+	it = Config::options.find("crypt-no-write-workqueue");
+	if (it != Config::options.end()) {
+		Config::cryptNoWriteWorkqueue = (Config::options["crypt-no-write-workqueue"] == "true");
+	}
+
+	it = Config::options.find("crypt-persistent-flags");
+	if (it != Config::options.end()) {
+		Config::cryptPersistentFlags = (Config::options["crypt-persistent-flags"] == "true");
+	}
+
+	it = Config::options.find("keyring-description");
+	if (it != Config::options.end()) {
+		Config::keyringDescription = Config::options["keyring-description"];
+	}
+
+	it = Config::options.find("keyring-timeout");
+	if (it != Config::options.end()) {
+		Config::keyringTimeout = std::stoi(Config::options["keyring-timeout"]);
+	}
+
+	it = Config::options.find("luks-devices");
+	if (it != Config::options.end()) {
+		Config::luksDevices.clear();
+		std::istringstream devices(Config::options["luks-devices"]);
+		for (std::string device; std::getline(devices, device, ',');) {
+			// Device names can't contain a colon, paths might
+			size_t colon = device.rfind(':');
+			if (colon == std::string::npos || colon == 0 || colon + 1 == device.size()) {
+				SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Invalid luks-devices entry, expected path:name: %s",
+					device.c_str());
+				return false;
+			}
+			Config::luksDevices.emplace_back(device.substr(0, colon), device.substr(colon + 1));
+		}
+	}
 	return true;
 }
 
@@ -21,6 +21,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define CONFIG_H
 #include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 struct argb {
 	unsigned char a;
@@ -42,6 +44,9 @@ public:
 	argb keyboardBackground = parseHexString("#0E0E12");
 	std::string keyboardFont = "DejaVu";
 	int keyboardFontSize = 24;
+	int keyboardRenderThreads = 0;
+	std::string keyboardCache = "";
+	bool keyboardAtlas = false;
 	std::string keyboardMap = "us";
 	argb keyForeground = parseHexString("#FFFFFF");
 	argb keyForegroundHighlighted = parseHexString("#000000");
@@ -59,6 +64,22 @@ public:
 	std::string inputBoxRadius = "0";
 	std::string inputBoxDotGlyph = "●";
 	bool animations = true;
+	bool kdfPriority = false;
+	bool cpufreqBoost = false;
+	std::string cpufreqSysfsRoot = "/sys";
+	std::string evdevDevices = "";
+	std::string keyslotCache = "";
+	bool keyslotParallel = false;
+	bool cryptAllowDiscards = true;
+	bool cryptSameCpuCrypt = false;
+	bool cryptSubmitFromCryptCpus = false;
+	bool cryptNoReadWorkqueue = true;
+	bool cryptNoWriteWorkqueue = true;
+	bool cryptPersistentFlags = false;
+	std::string keyringDescription = "";
+	int keyringTimeout = 150;
+	// Path and name of each luks device
+	std::vector<std::pair<std::string, std::string>> luksDevices;
 
 	/**
 	  Read from config file
@@ -0,0 +1,105 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cpufreq.h"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+constexpr char BOOST_GOVERNOR[] = "performance";
+
+void CpufreqBoost::setSysfsRoot(const std::string &path)
+{
+	if (savedGovernors.empty()) {
+		sysfsRoot = path;
+	}
+}
+
+bool CpufreqBoost::setGovernor(const std::string &path, const std::string &governor)
+{
+	std::ofstream os(path);
+	os << governor << "\n";
+	os.close();
+	if (!os) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to set governor %s in %s: %s", governor.c_str(), path.c_str(),
+			strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+int CpufreqBoost::boost()
+{
+	if (!savedGovernors.empty()) {
+		return static_cast<int>(savedGovernors.size());
+	}
+	std::filesystem::path cpufreq = std::filesystem::path(sysfsRoot) / "devices/system/cpu/cpufreq";
+	std::error_code error;
+	std::vector<std::filesystem::path> policies;
+	for (const auto &entry : std::filesystem::directory_iterator(cpufreq, error)) {
+		if (entry.path().filename().string().rfind("policy", 0) == 0) {
+			policies.push_back(entry.path());
+		}
+	}
+	if (error) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to list cpufreq policies in %s: %s", cpufreq.c_str(),
+			error.message().c_str());
+		return 0;
+	}
+	std::sort(policies.begin(), policies.end());
+
+	for (const auto &policy : policies) {
+		std::string governorPath = policy / "scaling_governor";
+		std::string current, available;
+		std::ifstream(governorPath) >> current;
+		std::getline(std::ifstream(policy / "scaling_available_governors"), available);
+		std::istringstream governors(available);
+		std::string governor;
+		bool offered = false;
+		while (governors >> governor) {
+			offered = offered || governor == BOOST_GOVERNOR;
+		}
+		if (current.empty() || current == BOOST_GOVERNOR || !offered) {
+			SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Leaving %s at governor %s", policy.filename().c_str(),
+				current.empty() ? "unknown" : current.c_str());
+			continue;
+		}
+		if (setGovernor(governorPath, BOOST_GOVERNOR)) {
+			SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Switched %s from governor %s to %s", policy.filename().c_str(),
+				current.c_str(), BOOST_GOVERNOR);
+			savedGovernors.emplace_back(governorPath, current);
+		}
+	}
+	return static_cast<int>(savedGovernors.size());
+}
+
+void CpufreqBoost::restore()
+{
+	for (const auto &saved : savedGovernors) {
+		if (setGovernor(saved.first, saved.second)) {
+			SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Restored governor %s in %s", saved.second.c_str(),
+				saved.first.c_str());
+		}
+	}
+	savedGovernors.clear();
+}
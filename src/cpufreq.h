@@ -0,0 +1,74 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPUFREQ_H
+#define CPUFREQ_H
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Switches all cpufreq policies to the performance governor for the duration of an unlock attempt, and puts the
+ * previous governors back afterwards
+ */
+class CpufreqBoost {
+public:
+	/**
+	  Constructor
+	  @param sysfsRoot Mount point of sysfs, can point to a fake tree for testing
+	  */
+	explicit CpufreqBoost(const std::string &sysfsRoot = "/sys")
+		: sysfsRoot(sysfsRoot)
+	{
+	}
+	/**
+	  Restore the previous governors if they were changed
+	  */
+	~CpufreqBoost() { restore(); };
+	CpufreqBoost(const CpufreqBoost &) = delete;
+	CpufreqBoost &operator=(const CpufreqBoost &) = delete;
+	/**
+	  Configure where sysfs is mounted. Only has an effect while not boosted.
+	  @param path Mount point of sysfs
+	  */
+	void setSysfsRoot(const std::string &path);
+	/**
+	  Switch every policy that offers it to the performance governor. Does nothing if already boosted.
+	  @return Number of policies switched
+	  */
+	int boost();
+	/**
+	  Put back the governors that were active before boost()
+	  */
+	void restore();
+
+private:
+	std::string sysfsRoot;
+	// Governor file of each switched policy, with the governor it had before
+	std::vector<std::pair<std::string, std::string>> savedGovernors;
+
+	/**
+	  Write a governor to a policy
+	  @param path Path of the scaling_governor file
+	  @param governor Name of the governor
+	  @return true on success, false otherwise
+	  */
+	static bool setGovernor(const std::string &path, const std::string &governor);
+};
+#endif
@@ -0,0 +1,429 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "evdevinput.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <poll.h>
+#include <sstream>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Events older than this have a timestamp from another clock, e.g. because EVIOCSCLOCKID is not supported
+constexpr int64_t MAX_EVENT_AGE_US = 10 * 1000 * 1000;
+
+constexpr size_t BITS_PER_LONG = 8 * sizeof(unsigned long);
+
+static bool testBit(const unsigned long *bits, int bit)
+{
+	return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+static int64_t monotonicMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t eventMicros(const input_event &event)
+{
+	return static_cast<int64_t>(event.input_event_sec) * 1000000 + event.input_event_usec;
+}
+
+// Scale a device coordinate to a screen coordinate
+static int scaleAxis(int value, const input_absinfo &abs, int screenSize)
+{
+	int64_t range = static_cast<int64_t>(abs.maximum) - abs.minimum + 1;
+	if (range <= 0) {
+		return 0;
+	}
+	int64_t scaled = (static_cast<int64_t>(value) - abs.minimum) * screenSize / range;
+	return static_cast<int>(std::clamp<int64_t>(scaled, 0, screenSize - 1));
+}
+
+int EvdevInput::start(const std::string &paths, int width, int height)
+{
+	screenWidth = width;
+	screenHeight = height;
+	if (paths == "auto") {
+		std::error_code error;
+		for (const auto &file : std::filesystem::directory_iterator("/dev/input", error)) {
+			std::string path = file.path().string();
+			if (path.rfind("/dev/input/event", 0) == 0) {
+				openDevice(path, true);
+			}
+		}
+	} else {
+		std::stringstream stream(paths);
+		std::string path;
+		while (std::getline(stream, path, ',')) {
+			if (!path.empty()) {
+				openDevice(path, false);
+			}
+		}
+	}
+	if (devices.empty()) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_INPUT, "No touchscreen found for evdev input, using SDL input");
+		return 1;
+	}
+
+	stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	mutex = SDL_CreateMutex();
+	if (stopFd < 0 || !mutex) {
+		SDL_LogError(SDL_LOG_CATEGORY_INPUT, "Unable to set up evdev input: %s",
+			stopFd < 0 ? strerror(errno) : SDL_GetError());
+		stop();
+		return 1;
+	}
+	SDL_AtomicSet(&reading, 1);
+	thread = SDL_CreateThread(run, "osk_evdev", this);
+	if (!thread) {
+		SDL_LogError(SDL_LOG_CATEGORY_INPUT, "Unable to start evdev input thread: %s", SDL_GetError());
+		stop();
+		return 1;
+	}
+	return 0;
+}
+
+void EvdevInput::stop()
+{
+	SDL_AtomicSet(&reading, 0);
+	if (thread) {
+		uint64_t one = 1;
+		if (write(stopFd, &one, sizeof(one)) != sizeof(one)) {
+			SDL_LogWarn(SDL_LOG_CATEGORY_INPUT, "Unable to stop evdev input thread: %s", strerror(errno));
+		}
+		SDL_WaitThread(thread, nullptr);
+		thread = nullptr;
+	}
+	for (auto &device : devices) {
+		closeDevice(device);
+	}
+	devices.clear();
+	if (stopFd >= 0) {
+		close(stopFd);
+		stopFd = -1;
+	}
+	SDL_DestroyMutex(mutex);
+	mutex = nullptr;
+	queue.clear();
+}
+
+bool EvdevInput::poll(TouchEvent &event)
+{
+	if (!mutex) {
+		return false;
+	}
+	SDL_LockMutex(mutex);
+	bool found = !queue.empty();
+	if (found) {
+		event = queue.front();
+		queue.pop_front();
+	} else {
+		// Cleared under the lock, so a touch queued after this always pushes a new event
+		SDL_AtomicSet(&wakePending, 0);
+	}
+	SDL_UnlockMutex(mutex);
+	return found;
+}
+
+bool EvdevInput::openDevice(const std::string &path, bool requireTouchscreen)
+{
+	Device device;
+	device.path = path;
+	device.fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (device.fd < 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_INPUT, "Unable to open %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	device.replay = fstat(device.fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (device.replay) {
+		// Recorded coordinates are taken as screen coordinates
+		device.multiTouch = true;
+		device.absX.maximum = screenWidth - 1;
+		device.absY.maximum = screenHeight - 1;
+		SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Replaying input events from %s", path.c_str());
+		devices.push_back(device);
+		return true;
+	}
+
+	unsigned long absBits[ABS_MAX / BITS_PER_LONG + 1] = {};
+	unsigned long propBits[INPUT_PROP_MAX / BITS_PER_LONG + 1] = {};
+	ioctl(device.fd, EVIOCGBIT(EV_ABS, sizeof(absBits)), absBits);
+	ioctl(device.fd, EVIOCGPROP(sizeof(propBits)), propBits);
+	device.multiTouch = testBit(absBits, ABS_MT_POSITION_X) && testBit(absBits, ABS_MT_POSITION_Y);
+	bool singleTouch = testBit(absBits, ABS_X) && testBit(absBits, ABS_Y);
+	// Touchpads report absolute positions too, but are not mapped to the screen
+	bool direct = testBit(propBits, INPUT_PROP_DIRECT);
+	if ((!device.multiTouch && !singleTouch) || (requireTouchscreen && !direct)) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Not a touchscreen: %s", path.c_str());
+		closeDevice(device);
+		return false;
+	}
+	ioctl(device.fd, EVIOCGABS(device.multiTouch ? ABS_MT_POSITION_X : ABS_X), &device.absX);
+	ioctl(device.fd, EVIOCGABS(device.multiTouch ? ABS_MT_POSITION_Y : ABS_Y), &device.absY);
+	// Timestamps comparable with the time they are handled at, instead of wall clock time that may jump
+	int clock = CLOCK_MONOTONIC;
+	if (ioctl(device.fd, EVIOCSCLOCKID, &clock) != 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_INPUT, "Unable to use monotonic timestamps for %s: %s", path.c_str(),
+			strerror(errno));
+	}
+	SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Reading touches from %s, x %d-%d, y %d-%d%s", path.c_str(),
+		device.absX.minimum, device.absX.maximum, device.absY.minimum, device.absY.maximum,
+		device.multiTouch ? ", multi-touch" : "");
+	devices.push_back(device);
+	return true;
+}
+
+void EvdevInput::closeDevice(Device &device)
+{
+	if (device.fd >= 0) {
+		close(device.fd);
+		device.fd = -1;
+	}
+}
+
+void EvdevInput::handleEvent(Device &device, int deviceIndex, const input_event &event)
+{
+	device.eventMicros = eventMicros(event);
+	if (event.type == EV_SYN) {
+		if (event.code == SYN_DROPPED) {
+			// The state is unknown until the next report, contacts that were down can't be finished properly
+			for (int i = 0; i < EVDEV_MAX_SLOTS; i++) {
+				Slot &slot = device.slots[i];
+				if (slot.wasActive) {
+					push({ TouchEventType::cancel, deviceIndex * EVDEV_MAX_SLOTS + i, slot.x, slot.y,
+						SDL_GetTicks() });
+				}
+				slot = Slot();
+			}
+			device.dropping = true;
+		} else if (event.code == SYN_REPORT) {
+			if (!device.dropping) {
+				flushSlots(device, deviceIndex);
+			}
+			device.dropping = false;
+		}
+		return;
+	}
+	if (device.dropping) {
+		return;
+	}
+
+	Slot *slot = nullptr;
+	if (device.currentSlot >= 0 && device.currentSlot < EVDEV_MAX_SLOTS) {
+		slot = &device.slots[device.currentSlot];
+	}
+	if (event.type == EV_ABS && device.multiTouch) {
+		switch (event.code) {
+		case ABS_MT_SLOT:
+			device.currentSlot = event.value;
+			break;
+		case ABS_MT_TRACKING_ID:
+			if (slot) {
+				slot->active = event.value >= 0;
+			}
+			break;
+		case ABS_MT_POSITION_X:
+			if (slot) {
+				slot->x = scaleAxis(event.value, device.absX, screenWidth);
+				slot->moved = true;
+			}
+			break;
+		case ABS_MT_POSITION_Y:
+			if (slot) {
+				slot->y = scaleAxis(event.value, device.absY, screenHeight);
+				slot->moved = true;
+			}
+			break;
+		}
+	} else if (event.type == EV_ABS) {
+		if (event.code == ABS_X) {
+			device.slots[0].x = scaleAxis(event.value, device.absX, screenWidth);
+			device.slots[0].moved = true;
+		} else if (event.code == ABS_Y) {
+			device.slots[0].y = scaleAxis(event.value, device.absY, screenHeight);
+			device.slots[0].moved = true;
+		}
+	} else if (event.type == EV_KEY && event.code == BTN_TOUCH && !device.multiTouch) {
+		device.slots[0].active = event.value != 0;
+	}
+}
+
+void EvdevInput::flushSlots(Device &device, int deviceIndex)
+{
+	Uint32 timestamp = SDL_GetTicks();
+	if (!device.replay) {
+		// Date the touches back to when the kernel saw them
+		int64_t ageMicros = monotonicMicros() - device.eventMicros;
+		if (ageMicros > 0 && ageMicros < MAX_EVENT_AGE_US) {
+			timestamp -= static_cast<Uint32>(ageMicros / 1000);
+		}
+	}
+	for (int i = 0; i < EVDEV_MAX_SLOTS; i++) {
+		Slot &slot = device.slots[i];
+		TouchEventType type;
+		if (slot.active && !slot.wasActive) {
+			type = TouchEventType::down;
+		} else if (slot.active && slot.moved) {
+			type = TouchEventType::motion;
+		} else if (!slot.active && slot.wasActive) {
+			type = TouchEventType::up;
+		} else {
+			slot.moved = false;
+			continue;
+		}
+		push({ type, deviceIndex * EVDEV_MAX_SLOTS + i, slot.x, slot.y, timestamp });
+		slot.wasActive = slot.active;
+		slot.moved = false;
+	}
+}
+
+void EvdevInput::push(const TouchEvent &event)
+{
+	SDL_LockMutex(mutex);
+	queue.push_back(event);
+	SDL_UnlockMutex(mutex);
+	// One SDL event per batch, the main loop takes all queued touches at once
+	if (SDL_AtomicCAS(&wakePending, 0, 1)) {
+		SDL_Event wake = {};
+		wake.type = eventType;
+		SDL_PushEvent(&wake);
+	}
+}
+
+void EvdevInput::finish()
+{
+	SDL_AtomicSet(&reading, 0);
+	// Pushed even if a wake is pending already, that one may be handled before the flag changed
+	SDL_Event wake = {};
+	wake.type = eventType;
+	SDL_PushEvent(&wake);
+}
+
+bool EvdevInput::readDevice(Device &device, int deviceIndex)
+{
+	input_event events[64];
+	while (true) {
+		ssize_t size = read(device.fd, events, sizeof(events));
+		if (size < 0 && errno == EINTR) {
+			continue;
+		}
+		if (size < 0 && errno == EAGAIN) {
+			return true;
+		}
+		if (size <= 0) {
+			return false;
+		}
+		for (size_t i = 0; i < static_cast<size_t>(size) / sizeof(input_event); i++) {
+			handleEvent(device, deviceIndex, events[i]);
+		}
+	}
+}
+
+int EvdevInput::replayDevice(Device &device, int deviceIndex)
+{
+	while (true) {
+		if (!device.hasPending) {
+			if (read(device.fd, &device.pending, sizeof(device.pending)) != sizeof(device.pending)) {
+				return -1;
+			}
+			device.hasPending = true;
+		}
+		int64_t recorded = eventMicros(device.pending);
+		if (device.replayBase < 0) {
+			device.replayBase = recorded;
+			device.replayStart = monotonicMicros();
+		}
+		int64_t waitMicros = device.replayStart + (recorded - device.replayBase) - monotonicMicros();
+		if (waitMicros > 0) {
+			return static_cast<int>((waitMicros + 999) / 1000);
+		}
+		device.hasPending = false;
+		handleEvent(device, deviceIndex, device.pending);
+	}
+}
+
+int EvdevInput::run(void *evdevInput)
+{
+	auto input = static_cast<EvdevInput *>(evdevInput);
+	// Nothing else on this thread, and the sooner a touch is read the sooner its key lights up
+	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+
+	std::vector<struct pollfd> fds;
+	std::vector<int> fdDevices;
+	while (true) {
+		int timeout = -1;
+		fds.clear();
+		fdDevices.clear();
+		fds.push_back({ input->stopFd, POLLIN, 0 });
+		fdDevices.push_back(-1);
+		for (size_t i = 0; i < input->devices.size(); i++) {
+			Device &device = input->devices[i];
+			if (device.fd < 0) {
+				continue;
+			}
+			if (!device.replay) {
+				fds.push_back({ device.fd, POLLIN, 0 });
+				fdDevices.push_back(static_cast<int>(i));
+				continue;
+			}
+			int wait = input->replayDevice(device, static_cast<int>(i));
+			if (wait < 0) {
+				SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Finished replaying %s", device.path.c_str());
+				closeDevice(device);
+			} else if (timeout < 0 || wait < timeout) {
+				timeout = wait;
+			}
+		}
+		if (fds.size() == 1 && timeout < 0) {
+			SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "No evdev input device left");
+			input->finish();
+			return 0;
+		}
+
+		if (::poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+			SDL_LogError(SDL_LOG_CATEGORY_INPUT, "Unable to wait for input: %s", strerror(errno));
+			input->finish();
+			return 1;
+		}
+		if (fds[0].revents & POLLIN) {
+			return 0;
+		}
+		for (size_t j = 1; j < fds.size(); j++) {
+			if (!fds[j].revents) {
+				continue;
+			}
+			Device &device = input->devices[fdDevices[j]];
+			if (!input->readDevice(device, fdDevices[j]) || (fds[j].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+				SDL_LogWarn(SDL_LOG_CATEGORY_INPUT, "Lost input device %s", device.path.c_str());
+				closeDevice(device);
+			}
+		}
+	}
+}
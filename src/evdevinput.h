@@ -0,0 +1,197 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVDEVINPUT_H
+#define EVDEVINPUT_H
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_thread.h>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <linux/input.h>
+#include <string>
+#include <vector>
+
+// Contacts tracked per device, contacts in higher multi-touch slots are ignored
+constexpr int EVDEV_MAX_SLOTS = 10;
+
+enum class TouchEventType {
+	down,
+	motion,
+	up,
+	// The contact ended without a usable position, e.g. because the kernel dropped events
+	cancel
+};
+
+// A touch read from evdev, in screen coordinates
+struct TouchEvent {
+	TouchEventType type;
+	int64_t pointerId;
+	int x;
+	int y;
+	// SDL ticks at which the kernel saw the touch
+	Uint32 timestamp;
+};
+
+/*
+ * Reads touchscreens from /dev/input/event* on a thread of its own, bypassing the layers SDL input goes through
+ * on fbdev and DirectFB, e.g. tslib. Regular files with recorded input_event records are replayed at their
+ * recorded pace, for testing.
+ */
+class EvdevInput {
+public:
+	/**
+	  Constructor
+	  @param eventType SDL_EventType to push when touches are waiting to be read with poll()
+	  */
+	explicit EvdevInput(Uint32 eventType)
+		: eventType(eventType)
+	{
+	}
+	/**
+	  Stop the reader thread and close all devices
+	  */
+	~EvdevInput() { stop(); };
+	EvdevInput(const EvdevInput &) = delete;
+	EvdevInput &operator=(const EvdevInput &) = delete;
+	/**
+	  Open the devices and start reading them in the background
+	  @param devices Comma separated device paths or recorded event files, or "auto" for all touchscreens
+	  @param screenWidth Width of the screen, device coordinates are scaled to it
+	  @param screenHeight Height of the screen, device coordinates are scaled to it
+	  @return 0 on success, non-zero if no device could be opened or the thread could not be started
+	  */
+	int start(const std::string &devices, int screenWidth, int screenHeight);
+	/**
+	  Stop the reader thread and close all devices
+	  */
+	void stop();
+	/**
+	  Take the next touch. Once this returns false, the next touch pushes a new SDL event.
+	  @param event Will be set to the touch
+	  @return true if a touch was taken, false if none is waiting
+	  */
+	bool poll(TouchEvent &event);
+	/**
+	  Query whether touches are still being read. Once the last device is gone or the last recording is replayed,
+	  this turns false and one more SDL event is pushed, so that the caller can go back to SDL input.
+	  @return true while the reader thread runs, false otherwise
+	  */
+	bool isReading() const { return SDL_AtomicGet(&reading) != 0; };
+
+private:
+	struct Slot {
+		bool active = false;
+		bool wasActive = false;
+		bool moved = false;
+		int x = 0;
+		int y = 0;
+	};
+
+	struct Device {
+		std::string path;
+		int fd = -1;
+		// Regular file with recorded events, replayed at the recorded pace. Recordings must use the multi-touch
+		// slot protocol, with coordinates in screen pixels.
+		bool replay = false;
+		bool multiTouch = false;
+		// Set after SYN_DROPPED, events are ignored until the next SYN_REPORT
+		bool dropping = false;
+		input_absinfo absX = {};
+		input_absinfo absY = {};
+		std::array<Slot, EVDEV_MAX_SLOTS> slots;
+		int currentSlot = 0;
+		// Kernel time of the last event, in microseconds
+		int64_t eventMicros = 0;
+		// Recorded time of the first record and when replay started, in microseconds
+		int64_t replayBase = -1;
+		int64_t replayStart = 0;
+		// Record read from a replay file that is not due yet
+		input_event pending = {};
+		bool hasPending = false;
+	};
+
+	Uint32 eventType;
+	std::vector<Device> devices;
+	int screenWidth = 0;
+	int screenHeight = 0;
+	// eventfd the reader thread polls next to the devices, written to stop it
+	int stopFd = -1;
+	SDL_Thread *thread = nullptr;
+	SDL_mutex *mutex = nullptr;
+	std::deque<TouchEvent> queue;
+	SDL_atomic_t wakePending = {};
+	mutable SDL_atomic_t reading = {};
+
+	/**
+	  Open a device or recorded event file and add it to devices
+	  @param path Path of the device or file
+	  @param requireTouchscreen Whether to also skip devices with absolute axes that are not mapped to the screen,
+	  like touchpads
+	  @return true on success, false otherwise
+	  */
+	bool openDevice(const std::string &path, bool requireTouchscreen);
+	/**
+	  Close a device
+	  @param device Device to close
+	  */
+	static void closeDevice(Device &device);
+	/**
+	  Update the state of a device with an event, and queue touches on SYN_REPORT
+	  @param device Device that sent the event
+	  @param deviceIndex Index of the device, part of the pointer IDs
+	  @param event Event to handle
+	  */
+	void handleEvent(Device &device, int deviceIndex, const input_event &event);
+	/**
+	  Queue the touches of all slots that changed since the last SYN_REPORT
+	  @param device Device to use
+	  @param deviceIndex Index of the device, part of the pointer IDs
+	  */
+	void flushSlots(Device &device, int deviceIndex);
+	/**
+	  Queue a touch and wake the main loop if it is not awake already
+	  @param event Touch to queue
+	  */
+	void push(const TouchEvent &event);
+	/**
+	  Mark the reader thread as done and wake the main loop, so that it notices
+	  */
+	void finish();
+	/**
+	  Read everything a live device has available
+	  @param device Device to read
+	  @param deviceIndex Index of the device
+	  @return false once the device is gone, true otherwise
+	  */
+	bool readDevice(Device &device, int deviceIndex);
+	/**
+	  Handle all records of a replay file that are due
+	  @param device Replay file to read
+	  @param deviceIndex Index of the device
+	  @return Time until the next record is due in ms, -1 once the file is done
+	  */
+	int replayDevice(Device &device, int deviceIndex);
+	/**
+	  Reader thread
+	  @param evdevInput EvdevInput object to use, should represent 'this'
+	  */
+	static int run(void *evdevInput);
+};
+#endif
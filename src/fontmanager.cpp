@@ -0,0 +1,115 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fontmanager.h"
+#include <map>
+#include <tuple>
+
+struct FontFile {
+	void *data;
+	size_t size;
+};
+
+static std::map<std::string, FontFile> fontFiles;
+static std::map<std::tuple<std::string, int, SDL_threadID>, TTF_Font *> fonts;
+static unsigned fileReadsAvoided = 0;
+static unsigned fontLoadsAvoided = 0;
+
+static SDL_mutex *fontMutex()
+{
+	static SDL_mutex *mutex = SDL_CreateMutex();
+	return mutex;
+}
+
+// Must be called with the mutex held
+static const FontFile *loadFile(const std::string &path)
+{
+	auto it = fontFiles.find(path);
+	if (it != fontFiles.end()) {
+		fileReadsAvoided++;
+		return &it->second;
+	}
+	FontFile file;
+	file.data = SDL_LoadFile(path.c_str(), &file.size);
+	if (!file.data) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to read font %s: %s", path.c_str(), SDL_GetError());
+		return nullptr;
+	}
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Loaded font %s (%zu bytes)", path.c_str(), file.size);
+	return &fontFiles.emplace(path, file).first->second;
+}
+
+TTF_Font *FontManager::get(const std::string &path, int size)
+{
+	SDL_LockMutex(fontMutex());
+	auto key = std::make_tuple(path, size, SDL_ThreadID());
+	auto it = fonts.find(key);
+	if (it != fonts.end()) {
+		fontLoadsAvoided++;
+		SDL_UnlockMutex(fontMutex());
+		return it->second;
+	}
+
+	// Opening faces is not thread safe in FreeType, so this stays under the lock
+	TTF_Font *font = nullptr;
+	const FontFile *file = loadFile(path);
+	if (file) {
+		SDL_RWops *rw = SDL_RWFromConstMem(file->data, static_cast<int>(file->size));
+		font = TTF_OpenFontRW(rw, 1, size);
+		if (!font) {
+			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "TTF_OpenFontRW: %s", TTF_GetError());
+		} else {
+			fonts[key] = font;
+		}
+	}
+	SDL_UnlockMutex(fontMutex());
+	return font;
+}
+
+const void *FontManager::getData(const std::string &path, size_t *size)
+{
+	SDL_LockMutex(fontMutex());
+	const FontFile *file = loadFile(path);
+	SDL_UnlockMutex(fontMutex());
+	if (!file) {
+		*size = 0;
+		return nullptr;
+	}
+	*size = file->size;
+	return file->data;
+}
+
+void FontManager::closeAll()
+{
+	SDL_LockMutex(fontMutex());
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Font manager: opened %zu font(s) from %zu file(s), avoided %u font loads "
+										"and %u file reads",
+		fonts.size(), fontFiles.size(), fontLoadsAvoided, fileReadsAvoided);
+	for (auto &font : fonts) {
+		TTF_CloseFont(font.second);
+	}
+	fonts.clear();
+	for (auto &file : fontFiles) {
+		SDL_free(file.second.data);
+	}
+	fontFiles.clear();
+	fileReadsAvoided = 0;
+	fontLoadsAvoided = 0;
+	SDL_UnlockMutex(fontMutex());
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FONTMANAGER_H
+#define FONTMANAGER_H
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <string>
+
+/*
+ * Process-wide registry of fonts. Each font file is read into memory once, and each (path, size) pair is opened
+ * once per thread, since a TTF_Font must not be used from several threads at the same time.
+ */
+class FontManager {
+public:
+	/**
+	  Get a shared font handle. The handle is owned by the font manager and must not be closed by the caller.
+	  @param path Path to the TTF font file
+	  @param size Point size of the font
+	  @return Font handle, or nullptr on error
+	  */
+	static TTF_Font *get(const std::string &path, int size);
+	/**
+	  Get the contents of a font file
+	  @param path Path to the TTF font file
+	  @param size Will be set to the size of the returned data
+	  @return Contents of the file, owned by the font manager, or nullptr on error
+	  */
+	static const void *getData(const std::string &path, size_t *size);
+	/**
+	  Close all fonts and free all font data, and log how many loads were avoided. Call this before TTF_Quit.
+	  */
+	static void closeAll();
+};
+#endif
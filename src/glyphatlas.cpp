@@ -0,0 +1,209 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "glyphatlas.h"
+#include "draw_helpers.h"
+#include <algorithm>
+
+// Preferred width of the atlas, it grows if a single label is wider
+constexpr int ATLAS_WIDTH = 512;
+// Transparent gap between atlas entries
+constexpr int ATLAS_PADDING = 1;
+
+void GlyphAtlas::cleanup()
+{
+	if (texture) {
+		SDL_DestroyTexture(texture);
+		texture = nullptr;
+	}
+	glyphs.clear();
+}
+
+int GlyphAtlas::init(SDL_Renderer *renderer, TTF_Font *font, const std::vector<std::string> &labels, int radius)
+{
+	this->renderer = renderer;
+	this->radius = radius;
+
+	// Labels are rendered in white, so that tinting them gives the exact color
+	SDL_Color white = { 255, 255, 255, 255 };
+	std::map<std::string, SDL_Surface *> surfaces;
+	for (const auto &label : labels) {
+		if (label.empty() || surfaces.count(label)) {
+			continue;
+		}
+		SDL_Surface *surface = TTF_RenderUTF8_Blended(font, label.c_str(), white);
+		if (!surface) {
+			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "TTF_RenderUTF8_Blended: %s", TTF_GetError());
+			for (auto &it : surfaces) {
+				SDL_FreeSurface(it.second);
+			}
+			return 1;
+		}
+		surfaces[label] = surface;
+	}
+
+	// Simple shelf packing, the key shape goes first
+	int shapeSize = 2 * radius + 1;
+	width = std::max(ATLAS_WIDTH, shapeSize + ATLAS_PADDING);
+	for (const auto &it : surfaces) {
+		width = std::max(width, it.second->w + ATLAS_PADDING);
+	}
+	shape = { 0, 0, shapeSize, shapeSize };
+	int x = shapeSize + ATLAS_PADDING;
+	int y = 0;
+	int shelfHeight = shapeSize;
+	for (const auto &it : surfaces) {
+		if (x + it.second->w > width) {
+			x = 0;
+			y += shelfHeight + ATLAS_PADDING;
+			shelfHeight = 0;
+		}
+		glyphs[it.first] = { x, y, it.second->w, it.second->h };
+		x += it.second->w + ATLAS_PADDING;
+		shelfHeight = std::max(shelfHeight, it.second->h);
+	}
+	height = y + shelfHeight;
+
+	SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!atlas) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "CreateRGBSurface failed: %s", SDL_GetError());
+		for (auto &it : surfaces) {
+			SDL_FreeSurface(it.second);
+		}
+		return 1;
+	}
+	SDL_FillRect(atlas, nullptr, SDL_MapRGBA(atlas->format, 0, 0, 0, 0));
+
+	SDL_FillRect(atlas, &shape, SDL_MapRGBA(atlas->format, 255, 255, 255, 255));
+	if (radius > 0) {
+		smooth_corners_surface(atlas, SDL_MapRGBA(atlas->format, 0, 0, 0, 0), &shape, radius);
+	}
+	for (auto &it : surfaces) {
+		// Copy the alpha channel as is instead of blending it
+		SDL_SetSurfaceBlendMode(it.second, SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(it.second, nullptr, atlas, &glyphs[it.first]);
+		SDL_FreeSurface(it.second);
+	}
+
+	texture = SDL_CreateTextureFromSurface(renderer, atlas);
+	SDL_FreeSurface(atlas);
+	if (!texture) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to create atlas texture: %s", SDL_GetError());
+		return 1;
+	}
+	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Glyph atlas holds %zu labels in %dx%d pixels", glyphs.size(), width,
+		height);
+	return 0;
+}
+
+void GlyphAtlas::addShape(const SDL_Rect &dst, argb color)
+{
+	int r = std::min({ radius, dst.w / 2, dst.h / 2 });
+	if (r <= 0) {
+		addRect(dst, color);
+		return;
+	}
+
+	// Nine-patch: corners are copied, scaled down if the key is too small for the radius, and edges and center are
+	// stretched from the middle row and column of the shape
+	const int srcOffset[] = { 0, radius, radius + 1 };
+	const int srcLen[] = { radius, 1, radius };
+	const int dstX[] = { dst.x, dst.x + r, dst.x + dst.w - r };
+	const int dstW[] = { r, dst.w - 2 * r, r };
+	const int dstY[] = { dst.y, dst.y + r, dst.y + dst.h - r };
+	const int dstH[] = { r, dst.h - 2 * r, r };
+	for (int row = 0; row < 3; row++) {
+		for (int col = 0; col < 3; col++) {
+			if (dstW[col] <= 0 || dstH[row] <= 0) {
+				continue;
+			}
+			SDL_Rect src = { shape.x + srcOffset[col], shape.y + srcOffset[row], srcLen[col], srcLen[row] };
+			SDL_Rect part = { dstX[col], dstY[row], dstW[col], dstH[row] };
+			addQuad(src, part, color);
+		}
+	}
+}
+
+void GlyphAtlas::addRect(const SDL_Rect &dst, argb color)
+{
+	SDL_Rect center = { shape.x + radius, shape.y + radius, 1, 1 };
+	addQuad(center, dst, color);
+}
+
+void GlyphAtlas::addLabel(const std::string &label, const SDL_Rect &dst, argb color)
+{
+	auto it = glyphs.find(label);
+	if (it == glyphs.end()) {
+		return;
+	}
+	const SDL_Rect &src = it->second;
+	SDL_Rect target;
+	target.x = dst.x + ((dst.w / 2) - (src.w / 2));
+	target.y = dst.y + ((dst.h / 2) - (src.h / 2));
+	target.w = src.w;
+	target.h = src.h;
+	addQuad(src, target, color);
+}
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+void GlyphAtlas::addQuad(const SDL_Rect &src, const SDL_Rect &dst, argb color)
+{
+	const float u0 = static_cast<float>(src.x) / width;
+	const float v0 = static_cast<float>(src.y) / height;
+	const float u1 = static_cast<float>(src.x + src.w) / width;
+	const float v1 = static_cast<float>(src.y + src.h) / height;
+	const float x0 = dst.x;
+	const float y0 = dst.y;
+	const float x1 = dst.x + dst.w;
+	const float y1 = dst.y + dst.h;
+	const SDL_Color c = { color.r, color.g, color.b, color.a };
+
+	const int base = static_cast<int>(vertices.size());
+	vertices.push_back({ { x0, y0 }, c, { u0, v0 } });
+	vertices.push_back({ { x1, y0 }, c, { u1, v0 } });
+	vertices.push_back({ { x1, y1 }, c, { u1, v1 } });
+	vertices.push_back({ { x0, y1 }, c, { u0, v1 } });
+	for (int i : { 0, 1, 2, 0, 2, 3 }) {
+		indices.push_back(base + i);
+	}
+}
+
+void GlyphAtlas::flush(SDL_Renderer *renderer)
+{
+	if (!vertices.empty()) {
+		SDL_RenderGeometry(renderer, texture, vertices.data(), static_cast<int>(vertices.size()), indices.data(),
+			static_cast<int>(indices.size()));
+	}
+	vertices.clear();
+	indices.clear();
+}
+#else
+// Without SDL_RenderGeometry every quad is a separate copy, there is nothing to batch
+void GlyphAtlas::addQuad(const SDL_Rect &src, const SDL_Rect &dst, argb color)
+{
+	SDL_SetTextureColorMod(texture, color.r, color.g, color.b);
+	SDL_SetTextureAlphaMod(texture, color.a);
+	SDL_RenderCopy(renderer, texture, &src, &dst);
+}
+
+void GlyphAtlas::flush(SDL_Renderer *)
+{
+}
+#endif
@@ -0,0 +1,101 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GLYPHATLAS_H
+#define GLYPHATLAS_H
+#include "config.h"
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * A single texture holding white, alpha-only versions of a set of text labels and of a rounded key shape. Both are
+ * tinted when drawn, so one atlas serves every color. Draw calls are collected and sent to the renderer in one
+ * batch by flush() where SDL supports SDL_RenderGeometry.
+ */
+class GlyphAtlas {
+public:
+	/**
+	  Free memory allocated on creation/use of this object. The atlas object should be considered dead after
+	  calling this, and not used.
+	  */
+	void cleanup();
+	/**
+	  Rasterize the given labels and the key shape into the atlas texture
+	  @param renderer Initialized SDL_Renderer object
+	  @param font Font to use for the labels
+	  @param labels Labels to include, duplicates are stored once
+	  @param radius Corner radius of the key shape
+	  @return 0 on success, non-zero on error
+	  */
+	int init(SDL_Renderer *renderer, TTF_Font *font, const std::vector<std::string> &labels, int radius);
+	/**
+	  Queue drawing the key shape, stretched to fill a rectangle
+	  @param dst Rectangle to fill
+	  @param color Color to tint the shape with
+	  */
+	void addShape(const SDL_Rect &dst, argb color);
+	/**
+	  Queue drawing a filled rectangle with square corners
+	  @param dst Rectangle to fill
+	  @param color Color of the rectangle
+	  */
+	void addRect(const SDL_Rect &dst, argb color);
+	/**
+	  Queue drawing a label centered in a rectangle
+	  @param label Label to draw, must have been passed to init()
+	  @param dst Rectangle to center the label in
+	  @param color Color to tint the label with
+	  */
+	void addLabel(const std::string &label, const SDL_Rect &dst, argb color);
+	/**
+	  Draw everything queued since the last flush
+	  @param renderer Initialized SDL_Renderer object
+	  */
+	void flush(SDL_Renderer *renderer);
+	/**
+	  Get the size of the atlas texture
+	  @return Size of the texture in bytes
+	  */
+	size_t getTextureSize() const { return static_cast<size_t>(width) * height * 4; };
+
+private:
+	SDL_Texture *texture = nullptr;
+	SDL_Renderer *renderer = nullptr;
+	std::map<std::string, SDL_Rect> glyphs;
+	SDL_Rect shape = { 0, 0, 0, 0 };
+	int radius = 0;
+	int width = 0;
+	int height = 0;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	std::vector<SDL_Vertex> vertices;
+	std::vector<int> indices;
+#endif
+
+	/**
+	  Queue drawing part of the atlas
+	  @param src Rectangle in the atlas
+	  @param dst Rectangle on screen
+	  @param color Color to tint with
+	  */
+	void addQuad(const SDL_Rect &src, const SDL_Rect &dst, argb color);
+};
+#endif
@@ -20,6 +20,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "keyboard.h"
 #include "draw_helpers.h"
+#include "fontmanager.h"
+#include "glyphatlas.h"
+#include "keyboardcache.h"
+#include "trace.h"
+#include <algorithm>
+#include <limits>
 
 Keyboard::Keyboard(int pos, int targetPos, int width, int height, Config *config, SDL_Haptic *haptic)
 	: position(static_cast<float>(pos))
@@ -34,20 +40,28 @@ Keyboard::Keyboard(int pos, int targetPos, int width, int height, Config *config
 
 void Keyboard::cleanup()
 {
+	// Wait for background rasterization before freeing what it uses
+	pool.reset();
+
 	for (auto &layer : keyboard) {
+		freeSurface(layer);
 		if (layer.texture) {
 			SDL_DestroyTexture(layer.texture);
 			layer.texture = nullptr;
 		}
-		if (layer.highlightedTexture) {
-			SDL_DestroyTexture(layer.highlightedTexture);
-			layer.highlightedTexture = nullptr;
-		}
+	}
+	delete cache;
+	cache = nullptr;
+	if (atlas) {
+		atlas->cleanup();
+		delete atlas;
+		atlas = nullptr;
 	}
 }
 
 int Keyboard::init(SDL_Renderer *renderer)
 {
+	TRACE_SCOPE("Keyboard::init");
 	loadKeymap();
 	int keyLong = std::strtol(config->keyRadius.c_str(), nullptr, 10);
 	if (keyLong >= BEZIER_RESOLUTION || static_cast<double>(keyLong) > (keyboardHeight / 5.0) / 1.5) {
@@ -57,18 +71,55 @@ int Keyboard::init(SDL_Renderer *renderer)
 	} else {
 		keyRadius = keyLong;
 	}
+	this->renderer = renderer;
 	for (auto &layer : keyboard) {
-		layer.texture = makeKeyboardTexture(renderer, &layer, false);
-		if (!layer.texture) {
-			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to generate keyboard texture");
-			return 1;
-		}
-		layer.highlightedTexture = makeKeyboardTexture(renderer, &layer, true);
-		if (!layer.highlightedTexture) {
-			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to generate highlighted keyboard texture");
-			return 1;
+		layoutKeyboard(&layer);
+	}
+	if (config->keyboardAtlas) {
+		return initAtlas();
+	}
+	if (!config->keyboardCache.empty()) {
+		cache = new KeyboardCache(config->keyboardCache);
+		cacheKey = KeyboardCache::makeKey(*config, keyboardWidth, keyboardHeight, keyRadius);
+		if (cache->load(cacheKey, keyboardWidth, keyboardHeight, keyboard.size())) {
+			for (size_t i = 0; i < keyboard.size(); i++) {
+				auto &layer = keyboard[i];
+				layer.surface = cache->getSurface(i);
+				layer.queued = true;
+				if (!layer.surface) {
+					SDL_AtomicSet(&layer.failed, 1);
+				}
+			}
+		} else {
+			// Write a new cache once all layers have been rasterized
+			SDL_AtomicSet(&layersPending, static_cast<int>(keyboard.size()));
+			SDL_AtomicSet(&cacheState, CACHE_WRITE_PENDING);
 		}
 	}
+
+	int threadCount = config->keyboardRenderThreads;
+	if (threadCount <= 0) {
+		threadCount = WorkerPool::defaultThreadCount(4);
+	} else if (threadCount == 1) {
+		// Use the serial path on the render thread
+		threadCount = 0;
+	}
+	pool = std::make_unique<WorkerPool>(threadCount);
+
+	// Only the active layer is needed for the first frame, see warmUp() for the others. The atlas for the
+	// highlighted key is drawn here while the workers are busy with the layer.
+	Uint64 start = SDL_GetPerformanceCounter();
+	queueLayer(keyboard[activeLayer]);
+	if (initAtlas() || uploadLayer(keyboard[activeLayer])) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to generate keyboard textures");
+		return 1;
+	}
+	double wallMs = static_cast<double>(SDL_GetPerformanceCounter() - start) * 1000.0
+		/ static_cast<double>(SDL_GetPerformanceFrequency());
+	double serialMs = SDL_AtomicGet(&keyboard[activeLayer].busyMicros) / 1000.0;
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO,
+		"Keyboard layer %d ready in %.1f ms on %d thread(s), serial path would take %.1f ms (%.2fx)",
+		activeLayer, wallMs, pool->size(), serialMs, wallMs > 0 ? serialMs / wallMs : 1.0);
 	lastAnimTicks = SDL_GetTicks();
 	return 0;
 }
@@ -127,7 +178,17 @@ void Keyboard::draw(SDL_Renderer *renderer, int screenHeight)
 {
 	updateAnimations();
 
-	SDL_Rect keyboardRect, srcRect, highlightDstRect, highlightSrcRect;
+	// Surfaces kept around for writing the cache can go now
+	if (SDL_AtomicGet(&cacheState) == CACHE_WRITTEN) {
+		for (auto &layer : keyboard) {
+			if (layer.texture) {
+				freeSurface(layer);
+			}
+		}
+		SDL_AtomicSet(&cacheState, CACHE_NONE);
+	}
+
+	SDL_Rect keyboardRect, srcRect;
 
 	keyboardRect.x = 0;
 	keyboardRect.y = static_cast<int>(screenHeight - (keyboardHeight * position));
@@ -141,47 +202,55 @@ void Keyboard::draw(SDL_Renderer *renderer, int screenHeight)
 	srcRect.w = keyboardWidth;
 	srcRect.h = keyboardRect.h;
 
-	if (isKeyHighlighted) {
-		int padding = keyboardWidth / 100;
-
-		highlightSrcRect.x = highlightedKey.x1 + padding;
-		highlightSrcRect.y = highlightedKey.y1 + padding;
-		highlightSrcRect.w = highlightedKey.x2 - highlightedKey.x1 - 2 * padding;
-		highlightSrcRect.h = highlightedKey.y2 - highlightedKey.y1 - 2 * padding;
-
-		highlightDstRect = highlightSrcRect;
-		highlightDstRect.y += keyboardRect.y;
+	if (config->keyboardAtlas) {
+		atlas->addRect(keyboardRect, config->keyboardBackground);
+		for (const auto &cap : keyboard[activeLayer].keyCaps) {
+			argb background;
+			if (cap.style == KeyStyle::ret) {
+				background = config->keyBackgroundReturn;
+			} else if (cap.style == KeyStyle::other) {
+				background = config->keyBackgroundOther;
+			} else {
+				background = config->keyBackgroundLetter;
+			}
+			SDL_Rect keyRect = cap.rect;
+			keyRect.y += keyboardRect.y;
+			atlas->addShape(keyRect, background);
+			atlas->addLabel(cap.label, keyRect, config->keyForeground);
+		}
+	} else {
+		SDL_RenderCopy(renderer, keyboard[activeLayer].texture, &srcRect, &keyboardRect);
 	}
 
-	for (const auto &layer : keyboard) {
-		if (layer.layerNum != activeLayer) {
-			continue;
+	for (const auto &press : keyPresses) {
+		if (press.layer == activeLayer) {
+			drawHighlightedKey(press.index, keyboardRect.y);
 		}
+	}
+	atlas->flush(renderer);
+}
 
-		SDL_RenderCopy(renderer, layer.texture, &srcRect, &keyboardRect);
+void Keyboard::drawHighlightedKey(int index, int offsetY)
+{
+	const auto &layer = keyboard[activeLayer];
+	const touchArea &key = layer.keyVector[index];
+	const keyCap &cap = layer.keyCaps[index];
 
-		if (!isKeyHighlighted) {
-			continue;
-		}
+	SDL_Rect keyRect = cap.rect;
+	keyRect.y += offsetY;
 
-		// Fill rounded corners at intersection
-		if (highlightedKey.isPreviewEnabled && keyRadius > 0) {
-			SDL_SetRenderDrawColor(renderer, config->keyBackgroundHighlighted.r, config->keyBackgroundHighlighted.g,
-				config->keyBackgroundHighlighted.b, config->keyBackgroundHighlighted.a);
-			SDL_Rect cornerRect;
-			cornerRect.x = highlightSrcRect.x;
-			cornerRect.y = highlightSrcRect.y + keyboardRect.y - keyRadius;
-			cornerRect.w = highlightSrcRect.w;
-			cornerRect.h = 2 * keyRadius;
-			SDL_RenderFillRect(renderer, &cornerRect);
-		}
+	// Fill rounded corners at intersection
+	if (key.isPreviewEnabled && keyRadius > 0) {
+		SDL_Rect cornerRect = { keyRect.x, keyRect.y - keyRadius, keyRect.w, 2 * keyRadius };
+		atlas->addRect(cornerRect, config->keyBackgroundHighlighted);
+	}
 
-		// Draw highlighted key & preview
-		if (highlightedKey.isPreviewEnabled) {
-			SDL_RenderCopy(renderer, layer.highlightedTexture, &highlightSrcRect, &highlightDstRect);
-			highlightDstRect.y -= highlightDstRect.h;
-		}
-		SDL_RenderCopy(renderer, layer.highlightedTexture, &highlightSrcRect, &highlightDstRect);
+	// Draw highlighted key & preview
+	int count = key.isPreviewEnabled ? 2 : 1;
+	for (int i = 0; i < count; i++) {
+		atlas->addShape(keyRect, config->keyBackgroundHighlighted);
+		atlas->addLabel(cap.label, keyRect, config->keyForegroundHighlighted);
+		keyRect.y -= keyRect.h;
 	}
 }
 
@@ -190,125 +259,36 @@ bool Keyboard::isInSlideAnimation() const
 	return (fabs(getTargetPosition() - getPosition()) > 0.001);
 }
 
-void Keyboard::drawRow(SDL_Surface *surface, std::vector<touchArea> &keyVector, int x, int y, int width, int height,
-	const std::vector<std::string> &keys, int padding, TTF_Font *font, bool isHighlighted, bool isPreviewEnabled,
-	argb foreground, argb background) const
+void Keyboard::layoutRow(KeyboardLayer *layer, int row, int x, int y, int width, int height,
+	const std::vector<std::string> &keys, bool isPreviewEnabled, KeyStyle style)
 {
-	auto keyBackground = SDL_MapRGB(surface->format, background.r, background.g, background.b);
-	SDL_Color textColor = { foreground.r, foreground.g, foreground.b, foreground.a };
-
-	Uint32 keyboardBackground;
-	if (isHighlighted) {
-		// For the highlighted keys, we need to draw over the rounded corners with transparency because they will
-		// be rendered *on top of* the normal keys
-		keyboardBackground = SDL_MapRGBA(surface->format, 0, 0, 0, 0);
-	} else {
-		keyboardBackground = SDL_MapRGB(surface->format, config->keyboardBackground.r, config->keyboardBackground.g,
-			config->keyboardBackground.b);
-	}
-
 	int i = 0;
-	for (const auto &keyCap : keys) {
-		SDL_Rect keyRect;
-		keyRect.x = x + (i * width) + padding;
-		keyRect.y = y + padding;
-		keyRect.w = width - (2 * padding);
-		keyRect.h = height - (2 * padding);
-		SDL_FillRect(surface, &keyRect, keyBackground);
-		if (keyRadius > 0) {
-			smooth_corners_surface(surface, keyboardBackground, &keyRect, keyRadius);
-		}
-		SDL_Surface *textSurface;
-
-		if (!isHighlighted) {
-			keyVector.push_back({ keyCap, isPreviewEnabled, x + (i * width), x + (i * width) + width, y, y + height });
-		}
-
-		textSurface = TTF_RenderUTF8_Blended(font, keyCap.c_str(), textColor);
-
-		SDL_Rect keyCapRect;
-		keyCapRect.x = keyRect.x + ((keyRect.w / 2) - (textSurface->w / 2));
-		keyCapRect.y = keyRect.y + ((keyRect.h / 2) - (textSurface->h / 2));
-		keyCapRect.w = keyRect.w;
-		keyCapRect.h = keyRect.h;
-		SDL_BlitSurface(textSurface, nullptr, surface, &keyCapRect);
-		SDL_FreeSurface(textSurface);
-
+	for (const auto &key : keys) {
+		layoutKey(layer, row, x + (i * width), y, width, height, key.c_str(), key.c_str(), KeyAction::character,
+			isPreviewEnabled, style);
 		i++;
 	}
 }
 
-void Keyboard::drawKey(SDL_Surface *surface, std::vector<touchArea> &keyVector, int x, int y, int width, int height,
-	char *cap, const char *key, int padding, TTF_Font *font, bool isHighlighted, bool isPreviewEnabled, argb foreground,
-	argb background) const
+void Keyboard::layoutKey(KeyboardLayer *layer, int row, int x, int y, int width, int height, const char *cap,
+	const char *key, KeyAction action, bool isPreviewEnabled, KeyStyle style)
 {
-	auto keyBackground = SDL_MapRGB(surface->format, background.r, background.g, background.b);
-	SDL_Color textColor = { foreground.r, foreground.g, foreground.b, foreground.a };
-
-	Uint32 keyboardBackground;
-	if (isHighlighted) {
-		// For the highlighted keys, we need to draw over the rounded corners with transparency because they will
-		// be rendered *on top of* the normal keys
-		keyboardBackground = SDL_MapRGBA(surface->format, 0, 0, 0, 0);
-	} else {
-		keyboardBackground = SDL_MapRGB(surface->format, config->keyboardBackground.r, config->keyboardBackground.g,
-			config->keyboardBackground.b);
-	}
+	int padding = keyboardWidth / 100;
 
 	SDL_Rect keyRect;
 	keyRect.x = x + padding;
 	keyRect.y = y + padding;
 	keyRect.w = width - (2 * padding);
 	keyRect.h = height - (2 * padding);
-	SDL_FillRect(surface, &keyRect, keyBackground);
-	if (keyRadius > 0) {
-		smooth_corners_surface(surface, keyboardBackground, &keyRect, keyRadius);
-	}
-	SDL_Surface *textSurface;
 
-	if (!isHighlighted) {
-		keyVector.push_back({ key, isPreviewEnabled, x, x + width, y, y + height });
-	}
-
-	textSurface = TTF_RenderUTF8_Blended(font, cap, textColor);
-
-	SDL_Rect keyCapRect;
-	keyCapRect.x = keyRect.x + ((keyRect.w / 2) - (textSurface->w / 2));
-	keyCapRect.y = keyRect.y + ((keyRect.h / 2) - (textSurface->h / 2));
-	keyCapRect.w = keyRect.w;
-	keyCapRect.h = keyRect.h;
-	SDL_BlitSurface(textSurface, nullptr, surface, &keyCapRect);
-	SDL_FreeSurface(textSurface);
+	layer->keyVector.push_back({ x, x + width, y, y + height, internKeyText(key), action, isPreviewEnabled });
+	layer->keyCaps.push_back({ cap, style, row, keyRect });
 }
 
-SDL_Surface *Keyboard::makeKeyboard(KeyboardLayer *layer, bool isHighlighted) const
+void Keyboard::layoutKeyboard(KeyboardLayer *layer)
 {
-	SDL_Surface *surface;
-	Uint32 rmask, gmask, bmask;
-
-	/* SDL interprets each pixel as a 32-bit number, so our masks must depend
-	   on the endianness (byte order) of the machine */
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-	rmask = 0xff000000;
-	gmask = 0x00ff0000;
-	bmask = 0x0000ff00;
-#else
-	rmask = 0x000000ff;
-	gmask = 0x0000ff00;
-	bmask = 0x00ff0000;
-#endif
-
-	surface = SDL_CreateRGBSurface(SDL_SWSURFACE, keyboardWidth, keyboardHeight, 32, rmask, gmask, bmask, 0);
-
-	if (surface == nullptr) {
-		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "CreateRGBSurface failed: %s", SDL_GetError());
-		return nullptr;
-	}
-
-	if (!isHighlighted) {
-		SDL_FillRect(surface, nullptr,
-			SDL_MapRGB(surface->format, config->keyboardBackground.r, config->keyboardBackground.g, config->keyboardBackground.b));
-	}
+	layer->keyVector.clear();
+	layer->keyCaps.clear();
 
 	int rowKeyWidth = keyboardWidth / 10;
 	int rowOffset = 0;
@@ -322,17 +302,6 @@ SDL_Surface *Keyboard::makeKeyboard(KeyboardLayer *layer, bool isHighlighted) co
 		rowHeight = keyboardHeight / rowCount;
 	}
 
-	TTF_Font *font = TTF_OpenFont(config->keyboardFont.c_str(), config->keyboardFontSize);
-	if (!font) {
-		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "TTF_OpenFont: %s", TTF_GetError());
-		return nullptr;
-	}
-
-	argb keyForeground = isHighlighted ? config->keyForegroundHighlighted : config->keyForeground;
-	argb keyBackgroundLetter = isHighlighted ? config->keyBackgroundHighlighted : config->keyBackgroundLetter;
-	argb keyBackgroundReturn = isHighlighted ? config->keyBackgroundHighlighted : config->keyBackgroundReturn;
-	argb keyBackgroundOther = isHighlighted ? config->keyBackgroundHighlighted : config->keyBackgroundOther;
-
 	// Divide the bottom row in 20 columns and use that for calculations
 	int colw = keyboardWidth / 20;
 
@@ -346,84 +315,358 @@ SDL_Surface *Keyboard::makeKeyboard(KeyboardLayer *layer, bool isHighlighted) co
 			x = keyboardWidth / 20;
 		if (i == 3) /* leave room for shift, "123" or "=\<" key */
 			x = keyboardWidth / 20 + colw * 2;
-		argb keyBackground = i == 0 ? keyBackgroundOther : keyBackgroundLetter;
-		drawRow(surface, layer->keyVector, x, y, rowKeyWidth,
-			rowHeight, layer->rows[i], keyboardWidth / 100, font, isHighlighted, config->keyPreview, keyForeground, keyBackground);
+		KeyStyle style = i == 0 ? KeyStyle::other : KeyStyle::letter;
+		layoutRow(layer, i, x, y, rowKeyWidth, rowHeight, layer->rows[i], config->keyPreview, style);
 		y += rowHeight;
 		i++;
 	}
 
 	/* Bottom-left key, 123 or ABC key based on which layer we're on: */
 	if (layer->layerNum < 2) {
-		char nums[] = "123";
-		drawKey(surface, layer->keyVector, colw, y, colw * 3, rowHeight,
-			nums, KEYCAP_NUMBERS, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundOther);
+		layoutKey(layer, rowCount, colw, y, colw * 3, rowHeight, "123", KEYCAP_NUMBERS, KeyAction::numbers, false,
+			KeyStyle::other);
 	} else {
-		char abc[] = "abc";
-		drawKey(surface, layer->keyVector, colw, y, colw * 3, rowHeight,
-			abc, KEYCAP_ABC, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundOther);
+		layoutKey(layer, rowCount, colw, y, colw * 3, rowHeight, "abc", KEYCAP_ABC, KeyAction::abc, false,
+			KeyStyle::other);
 	}
 	/* Shift-key that transforms into "123" or "=\<" depending on layer: */
 	if (layer->layerNum == 2) {
-		char symb[] = "=\\<";
-		drawKey(surface, layer->keyVector, 0, y - rowHeight,
-			sidebuttonsWidth, rowHeight,
-			symb, KEYCAP_SYMBOLS, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundOther);
+		layoutKey(layer, rowCount - 1, 0, y - rowHeight, sidebuttonsWidth, rowHeight, "=\\<", KEYCAP_SYMBOLS,
+			KeyAction::symbols, false, KeyStyle::other);
 	} else if (layer->layerNum == 3) {
-		char nums[] = "123";
-		drawKey(surface, layer->keyVector, 0, y - rowHeight,
-			sidebuttonsWidth, rowHeight,
-			nums, KEYCAP_NUMBERS, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundOther);
+		layoutKey(layer, rowCount - 1, 0, y - rowHeight, sidebuttonsWidth, rowHeight, "123", KEYCAP_NUMBERS,
+			KeyAction::numbers, false, KeyStyle::other);
 	} else {
-		char shift[64] = "";
-		memcpy(shift, KEYCAP_SHIFT, strlen(KEYCAP_SHIFT) + 1);
-		drawKey(surface, layer->keyVector, 0, y - rowHeight,
-			sidebuttonsWidth, rowHeight,
-			shift, KEYCAP_SHIFT, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundOther);
+		layoutKey(layer, rowCount - 1, 0, y - rowHeight, sidebuttonsWidth, rowHeight, KEYCAP_SHIFT, KEYCAP_SHIFT,
+			KeyAction::shift, false, KeyStyle::other);
 	}
 	/* Backspace key that is larger-sized (hence also drawn separately) */
-	{
-		char bcksp[64];
-		memcpy(bcksp, KEYCAP_BACKSPACE,
-			strlen(KEYCAP_BACKSPACE) + 1);
-		drawKey(surface, layer->keyVector, keyboardWidth / 20 + colw * 16,
-			y - rowHeight, sidebuttonsWidth, rowHeight,
-			bcksp, KEYCAP_BACKSPACE, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundOther);
+	layoutKey(layer, rowCount - 1, keyboardWidth / 20 + colw * 16, y - rowHeight, sidebuttonsWidth, rowHeight,
+		KEYCAP_BACKSPACE, KEYCAP_BACKSPACE, KeyAction::backspace, false, KeyStyle::other);
+
+	layoutKey(layer, rowCount, colw * 5, y, colw * 8, rowHeight, " ", KEYCAP_SPACE, KeyAction::character, false,
+		KeyStyle::letter);
+	layoutKey(layer, rowCount, colw * 13, y, colw * 2, rowHeight, ".", KEYCAP_PERIOD, KeyAction::character,
+		config->keyPreview, KeyStyle::other);
+	layoutKey(layer, rowCount, colw * 15, y, colw * 5, rowHeight, "OK", KEYCAP_RETURN, KeyAction::ret, false,
+		KeyStyle::ret);
+
+	buildKeyGrid(layer, rowHeight);
+}
+
+void Keyboard::buildKeyGrid(KeyboardLayer *layer, int rowHeight) const
+{
+	layer->gridRowHeight = std::max(rowHeight, 1);
+	layer->gridRows = 0;
+	for (const auto &key : layer->keyVector) {
+		layer->gridRows = std::max(layer->gridRows, key.y1 / layer->gridRowHeight + 1);
+	}
+	size_t cellCount = static_cast<size_t>(layer->gridRows) * keyboardWidth;
+	layer->keyGrid.assign(cellCount, NO_KEY);
+	if (layer->keyVector.size() >= NO_KEY) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Too many keys on layer %d", layer->layerNum);
+		return;
 	}
 
-	char space[] = " ";
-	drawKey(surface, layer->keyVector, colw * 5, y, colw * 8, rowHeight,
-		space, KEYCAP_SPACE, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundLetter);
+	// Every key claims the cells of its row it is closest to, which covers the gaps between keys too
+	std::vector<int> distance(cellCount, std::numeric_limits<int>::max());
+	for (size_t i = 0; i < layer->keyVector.size(); i++) {
+		const auto &key = layer->keyVector[i];
+		size_t rowStart = static_cast<size_t>(key.y1 / layer->gridRowHeight) * keyboardWidth;
+		for (int x = 0; x < keyboardWidth; x++) {
+			int keyDistance = 0;
+			if (x < key.x1) {
+				keyDistance = key.x1 - x;
+			} else if (x >= key.x2) {
+				keyDistance = x - key.x2 + 1;
+			}
+			if (keyDistance < distance[rowStart + x]) {
+				distance[rowStart + x] = keyDistance;
+				layer->keyGrid[rowStart + x] = static_cast<uint8_t>(i);
+			}
+		}
+	}
+}
+
+uint16_t Keyboard::internKeyText(const char *text)
+{
+	for (size_t i = 0; i < keyTexts.size(); i++) {
+		if (keyTexts[i] == text) {
+			return static_cast<uint16_t>(i);
+		}
+	}
+	keyTexts.emplace_back(text);
+	return static_cast<uint16_t>(keyTexts.size() - 1);
+}
+
+SDL_Surface *Keyboard::makeKeyboardSurface() const
+{
+	SDL_Surface *surface;
+	Uint32 rmask, gmask, bmask;
+
+	/* SDL interprets each pixel as a 32-bit number, so our masks must depend
+	   on the endianness (byte order) of the machine */
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+	rmask = 0xff000000;
+	gmask = 0x00ff0000;
+	bmask = 0x0000ff00;
+#else
+	rmask = 0x000000ff;
+	gmask = 0x0000ff00;
+	bmask = 0x00ff0000;
+#endif
 
-	char period[] = ".";
-	drawKey(surface, layer->keyVector, colw * 13, y, colw * 2, rowHeight,
-		period, KEYCAP_PERIOD, keyboardWidth / 100, font, isHighlighted, config->keyPreview, keyForeground, keyBackgroundOther);
+	surface = SDL_CreateRGBSurface(SDL_SWSURFACE, keyboardWidth, keyboardHeight, 32, rmask, gmask, bmask, 0);
 
-	char enter[] = "OK";
-	drawKey(surface, layer->keyVector, colw * 15, y, colw * 5, rowHeight,
-		enter, KEYCAP_RETURN, keyboardWidth / 100, font, isHighlighted, false, keyForeground, keyBackgroundReturn);
+	if (surface == nullptr) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "CreateRGBSurface failed: %s", SDL_GetError());
+		return nullptr;
+	}
 
-	TTF_CloseFont(font);
+	SDL_FillRect(surface, nullptr,
+		SDL_MapRGB(surface->format, config->keyboardBackground.r, config->keyboardBackground.g, config->keyboardBackground.b));
 
 	return surface;
 }
 
-SDL_Texture *Keyboard::makeKeyboardTexture(SDL_Renderer *renderer, KeyboardLayer *layer, bool isHighlighted) const
+int Keyboard::drawKeys(SDL_Surface *surface, const KeyboardLayer &layer, int row, TTF_Font *font) const
 {
-	SDL_Surface *surface = makeKeyboard(layer, isHighlighted);
-	if (!surface) {
-		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to generate keyboard surface");
-		return nullptr;
+	// Find the band of the surface covered by this row
+	int top = keyboardHeight;
+	int bottom = 0;
+	for (const auto &cap : layer.keyCaps) {
+		if (cap.row == row) {
+			top = std::min(top, cap.rect.y);
+			bottom = std::max(bottom, cap.rect.y + cap.rect.h);
+		}
+	}
+	if (top >= bottom) {
+		return 0;
+	}
+
+	// Every row gets its own surface header pointing into the shared pixels, since blitting onto a surface
+	// modifies its bookkeeping and would race with other rows
+	SDL_Surface *band = SDL_CreateRGBSurfaceFrom(static_cast<Uint8 *>(surface->pixels) + top * surface->pitch,
+		surface->w, bottom - top, 32, surface->pitch, surface->format->Rmask, surface->format->Gmask,
+		surface->format->Bmask, surface->format->Amask);
+	if (!band) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "CreateRGBSurfaceFrom failed: %s", SDL_GetError());
+		return 1;
+	}
+
+	Uint32 keyboardBackground = SDL_MapRGB(band->format, config->keyboardBackground.r, config->keyboardBackground.g,
+		config->keyboardBackground.b);
+	SDL_Color textColor = { config->keyForeground.r, config->keyForeground.g, config->keyForeground.b,
+		config->keyForeground.a };
+
+	for (const auto &cap : layer.keyCaps) {
+		if (cap.row != row) {
+			continue;
+		}
+
+		argb background;
+		if (cap.style == KeyStyle::ret) {
+			background = config->keyBackgroundReturn;
+		} else if (cap.style == KeyStyle::other) {
+			background = config->keyBackgroundOther;
+		} else {
+			background = config->keyBackgroundLetter;
+		}
+
+		SDL_Rect keyRect = cap.rect;
+		keyRect.y -= top;
+		SDL_FillRect(band, &keyRect, SDL_MapRGB(band->format, background.r, background.g, background.b));
+		if (keyRadius > 0) {
+			smooth_corners_surface(band, keyboardBackground, &keyRect, keyRadius);
+		}
+
+		SDL_Surface *textSurface = TTF_RenderUTF8_Blended(font, cap.label.c_str(), textColor);
+		if (!textSurface) {
+			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "TTF_RenderUTF8_Blended: %s", TTF_GetError());
+			SDL_FreeSurface(band);
+			return 1;
+		}
+
+		SDL_Rect keyCapRect;
+		keyCapRect.x = keyRect.x + ((keyRect.w / 2) - (textSurface->w / 2));
+		keyCapRect.y = keyRect.y + ((keyRect.h / 2) - (textSurface->h / 2));
+		keyCapRect.w = keyRect.w;
+		keyCapRect.h = keyRect.h;
+		SDL_BlitSurface(textSurface, nullptr, band, &keyCapRect);
+		SDL_FreeSurface(textSurface);
+	}
+
+	SDL_FreeSurface(band);
+	return 0;
+}
+
+void Keyboard::queueLayer(KeyboardLayer &layer)
+{
+	if (layer.queued) {
+		return;
+	}
+	layer.queued = true;
+
+	layer.surface = makeKeyboardSurface();
+	if (!layer.surface) {
+		SDL_AtomicSet(&layer.failed, 1);
+		return;
+	}
+
+	// One job per row of keys, the last row holds the space bar etc.
+	SDL_AtomicSet(&layer.pendingJobs, static_cast<int>(layer.rows.size() + 1));
+	for (size_t row = 0; row <= layer.rows.size(); row++) {
+		pool->submit([this, row, &layer](int) {
+			TRACE_SCOPE("Keyboard::drawKeys");
+			Uint64 jobStart = SDL_GetPerformanceCounter();
+			// The font manager hands each worker thread its own font
+			TTF_Font *font = FontManager::get(config->keyboardFont, config->keyboardFontSize);
+			if (!font || drawKeys(layer.surface, layer, row, font)) {
+				SDL_AtomicSet(&layer.failed, 1);
+			}
+			Uint64 jobTicks = SDL_GetPerformanceCounter() - jobStart;
+			SDL_AtomicAdd(&layer.busyMicros, static_cast<int>(jobTicks * 1000000 / SDL_GetPerformanceFrequency()));
+			if (SDL_AtomicAdd(&layer.pendingJobs, -1) == 1 && SDL_AtomicGet(&cacheState) == CACHE_WRITE_PENDING
+				&& SDL_AtomicAdd(&layersPending, -1) == 1) {
+				// This was the last row of the last layer
+				writeCache();
+			}
+		});
+	}
+}
+
+int Keyboard::uploadLayer(KeyboardLayer &layer)
+{
+	if (layer.texture) {
+		return 0;
+	}
+
+	queueLayer(layer);
+	if (SDL_AtomicGet(&layer.pendingJobs) > 0) {
+		// Not done in the background yet, so finish it now rather than showing an empty keyboard
+		SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Waiting for keyboard layer %d to be rasterized", layer.layerNum);
+		pool->waitFor(layer.pendingJobs);
+	}
+
+	int ret = 0;
+	if (SDL_AtomicGet(&layer.failed)) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to generate surfaces for keyboard layer %d", layer.layerNum);
+		ret = 1;
+	} else {
+		layer.texture = SDL_CreateTextureFromSurface(renderer, layer.surface);
+		if (!layer.texture) {
+			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to create keyboard texture: %s", SDL_GetError());
+			ret = 1;
+		} else {
+			SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Uploaded keyboard layer %d, rasterizing it took %.1f ms of CPU time",
+				layer.layerNum, SDL_AtomicGet(&layer.busyMicros) / 1000.0);
+		}
+	}
+
+	if (ret && SDL_AtomicGet(&cacheState) == CACHE_WRITE_PENDING) {
+		// Rasterizing the layer again would count it towards layersPending twice, so give up on the cache. This
+		// stops new writeCache() calls, and waiting for the pool lets one that is reading the surfaces finish.
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Not writing keyboard cache, layer %d failed", layer.layerNum);
+		SDL_AtomicSet(&cacheState, CACHE_WRITTEN);
+		pool->wait();
+	}
+	// The surface is not needed anymore unless it still has to go into the cache, a failed layer is rasterized
+	// again on the next attempt
+	if (ret || SDL_AtomicGet(&cacheState) != CACHE_WRITE_PENDING) {
+		freeSurface(layer);
+	}
+	if (ret) {
+		if (layer.texture) {
+			SDL_DestroyTexture(layer.texture);
+			layer.texture = nullptr;
+		}
+		layer.queued = false;
+		SDL_AtomicSet(&layer.failed, 0);
+		SDL_AtomicSet(&layer.busyMicros, 0);
+	}
+	return ret;
+}
+
+void Keyboard::freeSurface(KeyboardLayer &layer)
+{
+	if (layer.surface) {
+		SDL_FreeSurface(layer.surface);
+		layer.surface = nullptr;
+	}
+}
+
+int Keyboard::initAtlas()
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+	std::vector<std::string> labels;
+	for (const auto &layer : keyboard) {
+		for (const auto &cap : layer.keyCaps) {
+			labels.push_back(cap.label);
+		}
+	}
+
+	TTF_Font *font = FontManager::get(config->keyboardFont, config->keyboardFontSize);
+	if (!font) {
+		return 1;
+	}
+	atlas = new GlyphAtlas();
+	if (atlas->init(renderer, font, labels, keyRadius)) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to generate keyboard glyph atlas");
+		return 1;
+	}
+	double wallMs = static_cast<double>(SDL_GetPerformanceCounter() - start) * 1000.0
+		/ static_cast<double>(SDL_GetPerformanceFrequency());
+	if (config->keyboardAtlas) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO,
+			"Keyboard glyph atlas ready in %.1f ms, using %zu KiB of texture memory instead of %zu KiB for layer "
+			"textures",
+			wallMs, atlas->getTextureSize() / 1024,
+			static_cast<size_t>(keyboardWidth) * keyboardHeight * 4 * keyboard.size() / 1024);
+		lastAnimTicks = SDL_GetTicks();
+	} else {
+		SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Keyboard glyph atlas ready in %.1f ms, using %zu KiB of texture memory",
+			wallMs, atlas->getTextureSize() / 1024);
+	}
+	return 0;
+}
+
+void Keyboard::writeCache()
+{
+	for (auto &layer : keyboard) {
+		if (SDL_AtomicGet(&layer.failed) || !layer.surface) {
+			SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Not writing keyboard cache, layer %d is incomplete", layer.layerNum);
+			SDL_AtomicSet(&cacheState, CACHE_WRITTEN);
+			return;
+		}
+	}
+	cache->save(cacheKey, keyboard);
+	SDL_AtomicSet(&cacheState, CACHE_WRITTEN);
+}
+
+void Keyboard::warmUp()
+{
+	if (config->keyboardAtlas) {
+		return;
+	}
+	// Without worker threads this would block the render thread, layers are then rasterized on demand. The
+	// exception is a missing cache, which can only be written once all layers are done.
+	if (warmUpStarted || (pool->size() < 2 && SDL_AtomicGet(&cacheState) != CACHE_WRITE_PENDING)) {
+		return;
+	}
+	warmUpStarted = true;
+	for (auto &layer : keyboard) {
+		queueLayer(layer);
 	}
-	SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-	SDL_FreeSurface(surface);
-	return texture;
 }
 
 void Keyboard::setActiveLayer(int layerNum)
 {
 	if (layerNum >= 0) {
 		if (static_cast<size_t>(layerNum) <= keyboard.size() - 1) {
+			if (!config->keyboardAtlas && uploadLayer(keyboard[layerNum])) {
+				SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Keeping layer %i active", activeLayer);
+				return;
+			}
 			activeLayer = layerNum;
 			return;
 		}
@@ -479,35 +722,83 @@ void Keyboard::loadKeymap()
 	keyboard.push_back(layer3);
 }
 
-touchArea Keyboard::getKeyForCoordinates(int x, int y)
+const touchArea *Keyboard::getKeyForCoordinates(int x, int y) const
 {
-	for (const auto &layer : keyboard) {
-		if (layer.layerNum == activeLayer) {
-			for (const auto &it : layer.keyVector) {
-				if (x > it.x1 && x < it.x2 && y > it.y1 && y < it.y2) {
-					return it;
-				}
-			}
-		}
+	if (static_cast<size_t>(activeLayer) >= keyboard.size() || x < 0 || x >= keyboardWidth || y < 0) {
+		return nullptr;
+	}
+	const auto &layer = keyboard[activeLayer];
+	if (layer.gridRows == 0) {
+		return nullptr;
+	}
+	// Below the last row is only the rounding remainder of the row height
+	int row = std::min(y / layer.gridRowHeight, layer.gridRows - 1);
+	uint8_t index = layer.keyGrid[static_cast<size_t>(row) * keyboardWidth + x];
+	if (index == NO_KEY) {
+		return nullptr;
+	}
+	return &layer.keyVector[index];
+}
+
+std::vector<KeyPress>::iterator Keyboard::findKeyPress(int64_t pointerId)
+{
+	return std::find_if(keyPresses.begin(), keyPresses.end(),
+		[pointerId](const KeyPress &press) { return press.pointerId == pointerId && !press.released; });
+}
+
+bool Keyboard::pressKey(int64_t pointerId, const touchArea *key)
+{
+	auto stale = findKeyPress(pointerId);
+	if (stale != keyPresses.end()) {
+		keyPresses.erase(stale);
 	}
-	return { "", false, 0, 0, 0, 0 };
+	if (!key) {
+		return false;
+	}
+	int index = static_cast<int>(key - keyboard[activeLayer].keyVector.data());
+	keyPresses.push_back({ pointerId, activeLayer, index, false });
+	return true;
 }
 
-void Keyboard::setHighlightedKey(touchArea &area)
+bool Keyboard::moveKey(int64_t pointerId, const touchArea *key)
 {
-	highlightedKey = area;
-	isKeyHighlighted = true;
+	auto press = findKeyPress(pointerId);
+	if (press == keyPresses.end() || !key) {
+		return false;
+	}
+	int index = static_cast<int>(key - keyboard[activeLayer].keyVector.data());
+	if (press->layer == activeLayer && press->index == index) {
+		return false;
+	}
+	press->layer = activeLayer;
+	press->index = index;
+	return true;
 }
 
-void Keyboard::unsetHighlightedKey()
+void Keyboard::releaseKey(int64_t pointerId, const touchArea *key)
 {
-	highlightedKey = { "", false, 0, 0, 0, 0 };
-	isKeyHighlighted = false;
+	auto press = findKeyPress(pointerId);
+	if (press == keyPresses.end()) {
+		return;
+	}
+	if (!key) {
+		keyPresses.erase(press);
+		return;
+	}
+	press->layer = activeLayer;
+	press->index = static_cast<int>(key - keyboard[activeLayer].keyVector.data());
+	press->released = true;
 }
 
-touchArea Keyboard::getHighlightedKey()
+const touchArea *Keyboard::popCommittedKey()
 {
-	return highlightedKey;
+	if (keyPresses.empty() || !keyPresses.front().released) {
+		return nullptr;
+	}
+	const KeyPress &press = keyPresses.front();
+	const touchArea *key = &keyboard[press.layer].keyVector[press.index];
+	keyPresses.erase(keyPresses.begin());
+	return key;
 }
 
 void Keyboard::hapticRumble()
@@ -20,11 +20,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef KEYBOARD_H
 #define KEYBOARD_H
 #include "config.h"
+#include "workerpool.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 #include <cmath>
 #include <cstdint>
 #include <list>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -37,26 +39,83 @@ constexpr char KEYCAP_SPACE[] = " ";
 constexpr char KEYCAP_RETURN[] = "\n";
 constexpr char KEYCAP_PERIOD[] = ".";
 
+// What pressing a key does
+enum class KeyAction : uint8_t {
+	character,
+	backspace,
+	shift,
+	numbers,
+	symbols,
+	abc,
+	ret
+};
+
+// Marks grid cells that are not close to any key
+constexpr uint8_t NO_KEY = UINT8_MAX;
+
+// Pointer ID of the mouse, touches use their SDL_FingerID
+constexpr int64_t MOUSE_POINTER_ID = -1;
+
+/*
+ * Position and meaning of a key. Its text is interned in the keyboard, see Keyboard::getKeyText, so a layer's
+ * keys form one flat table that is looked up without allocating.
+ */
 struct touchArea {
-	std::string keyChar;
-	bool isPreviewEnabled;
 	int x1;
 	int x2;
 	int y1;
 	int y2;
+	uint16_t keyId;
+	KeyAction action;
+	bool isPreviewEnabled;
+};
+
+enum class KeyStyle {
+	letter,
+	ret,
+	other
 };
 
+struct keyCap {
+	std::string label;
+	KeyStyle style;
+	int row;
+	SDL_Rect rect;
+};
+
+class GlyphAtlas;
+class KeyboardCache;
+
 struct rgb {
 	unsigned char r;
 	unsigned char g;
 	unsigned char b;
 };
 
+// A key held down by a finger or the mouse, and released keys waiting for earlier presses to finish
+struct KeyPress {
+	int64_t pointerId;
+	int layer;
+	int index;
+	bool released;
+};
+
 struct KeyboardLayer {
 	SDL_Texture *texture = nullptr;
-	SDL_Texture *highlightedTexture = nullptr;
+	// Rasterized but not yet uploaded, written by worker threads until pendingJobs drops to 0
+	SDL_Surface *surface = nullptr;
+	SDL_atomic_t pendingJobs = {};
+	SDL_atomic_t failed = {};
+	SDL_atomic_t busyMicros = {};
+	bool queued = false;
 	std::array<std::vector<std::string>, 4> rows;
+	// Key caps and touch areas of the same key share an index
 	std::vector<touchArea> keyVector;
+	std::vector<keyCap> keyCaps;
+	// Index of the nearest key for every pixel column of every key row, NO_KEY for rows without keys
+	std::vector<uint8_t> keyGrid;
+	int gridRows = 0;
+	int gridRowHeight = 1;
 	int layerNum;
 };
 
@@ -79,26 +138,51 @@ public:
 	*/
 	void cleanup();
 	/**
-	  Get the character/key at the given coordinates
+	  Get the key of the active layer at the given coordinates. Coordinates in a gap between keys give the nearest
+	  key of the same row.
 	  @param x X-axis coordinate
 	  @param y Y-axis coordinate
-	  @return Touch area for the key at the given coordinates. When no key is found, keyChar will be an empty string.
+	  @return Touch area for the key at the given coordinates, valid as long as the keyboard, or nullptr when no key
+	  is found
+	  */
+	const touchArea *getKeyForCoordinates(int x, int y) const;
+	/**
+	  Get the text a key enters
+	  @param key Touch area of the key
+	  @return Text of the key
+	  */
+	const std::string &getKeyText(const touchArea &key) const { return keyTexts[key.keyId]; };
+	/**
+	  Start a key press, the key is highlighted until the press is committed or cancelled. A press of the same
+	  pointer that never saw its release is dropped.
+	  @param pointerId Finger ID of the touch, or MOUSE_POINTER_ID
+	  @param key Touch area of a key of the active layer, nullptr if the pointer is not on a key
+	  @return true if a key press was started, false otherwise
+	  */
+	bool pressKey(int64_t pointerId, const touchArea *key);
+	/**
+	  Move a key press to the key now under its pointer
+	  @param pointerId Finger ID of the touch, or MOUSE_POINTER_ID
+	  @param key Touch area of a key of the active layer, nullptr to keep the current key
+	  @return true if the press moved to another key, false otherwise
 	  */
-	touchArea getKeyForCoordinates(int x, int y);
+	bool moveKey(int64_t pointerId, const touchArea *key);
 	/**
-	  Set the key to be highlighted on the next render pass
-	  @param area Touch area of the key
+	  End a key press. The key is committed once all presses that started before it are committed or cancelled,
+	  so keys are entered in the order they were pressed, even when presses overlap.
+	  @param pointerId Finger ID of the touch, or MOUSE_POINTER_ID
+	  @param key Touch area of the key of the active layer under the pointer, nullptr to cancel the press
 	  */
-	void setHighlightedKey(touchArea &area);
+	void releaseKey(int64_t pointerId, const touchArea *key);
 	/**
-	  Unset the key to be highlighted on the next render pass
+	  Take the next committed key
+	  @return Touch area of the key, nullptr if no key is ready to be committed
 	  */
-	void unsetHighlightedKey();
+	const touchArea *popCommittedKey();
 	/**
-	  Get the currently highlighted key. If no key is highlighted, keyChar will be an empty string.
-	  @return Touch area of the key
+	  Cancel all key presses and remove their highlights
 	  */
-	touchArea getHighlightedKey();
+	void clearKeyPresses() { keyPresses.clear(); };
 	/**
 	  Get position of keyboard
 	  @return Position as a value between 0 and 1 (0% and 100%)
@@ -141,6 +225,11 @@ public:
 	  @return 0 on success, non-zero on error
 	  */
 	int init(SDL_Renderer *renderer);
+	/**
+	  Start rasterizing the inactive layers in the background, so switching to them later is instant. Call this
+	  once the first frame has been presented.
+	  */
+	void warmUp();
 	/**
 	  Query whether keyboard is currently sliding up/down.
 	  */
@@ -160,30 +249,40 @@ private:
 	int activeLayer = 0;
 	std::vector<KeyboardLayer> keyboard;
 	Config *config;
-	touchArea highlightedKey = { "", false, 0, 0, 0, 0 };
-	bool isKeyHighlighted = false;
+	// Key presses in the order they started, all of them are highlighted
+	std::vector<KeyPress> keyPresses;
+	// Text of all keys, indexed by touchArea::keyId
+	std::vector<std::string> keyTexts;
 	SDL_Haptic *haptic;
+	SDL_Renderer *renderer = nullptr;
+	std::unique_ptr<WorkerPool> pool;
+	bool warmUpStarted = false;
+	KeyboardCache *cache = nullptr;
+	uint64_t cacheKey = 0;
+	SDL_atomic_t cacheState = {};
+	SDL_atomic_t layersPending = {};
+	GlyphAtlas *atlas = nullptr;
+
+	enum {
+		CACHE_NONE,
+		CACHE_WRITE_PENDING,
+		CACHE_WRITTEN
+	};
 
 	/**
-	  Draw keyboard row
-	  @param surface Surface to draw on
-	  @param keyVector List of keys for keyboard layout
+	  Add a row of equally sized keys to the keyboard layout
+	  @param layer Keyboard layer to add the keys to
+	  @param row Index of the row, used to split up rasterization
 	  @param x X-axis coord. for start of row
 	  @param y Y-axis coord. for start of row
-	  @param width Width of row
+	  @param width Width of each key
 	  @param height Height of row
-	  @param cap Key cap
-	  @param key Key text
-	  @param padding Spacing to reserve around the key
-	  @param font Font to use for key character
-	  @param isHighlighted Whether the drawing is for the highlighted keys
-	  @param isPreviewEnabled Whether this key will show a preview on press
-	  @param foreground Foreground color for the keycap
-	  @param background Background color for the keycap
+	  @param keys Key text for each key, also used as key cap
+	  @param isPreviewEnabled Whether these keys will show a preview on press
+	  @param style Background style for the keys
 	  */
-	void drawRow(SDL_Surface *surface, std::vector<touchArea> &keyVector, int x, int y,
-		int width, int height, const std::vector<std::string> &keys, int padding,
-		TTF_Font *font, bool isHighlighted, bool isPreviewEnabled, argb foreground, argb background) const;
+	void layoutRow(KeyboardLayer *layer, int row, int x, int y, int width, int height,
+		const std::vector<std::string> &keys, bool isPreviewEnabled, KeyStyle style);
 
 	/**
 	  Internal function to gradually update the animations.
@@ -192,40 +291,91 @@ private:
 	void updateAnimations();
 
 	/**
-	  Draw key for keyboard
-	  @param surface Surface to draw on
-	  @param keyVector List of keys for keyboard layout
-	  @param x X-axis coord. for start of row
-	  @param y Y-axis coord. for start of row
-	  @param width Width of row
-	  @param height Height of row
+	  Add a single key to the keyboard layout
+	  @param layer Keyboard layer to add the key to
+	  @param row Index of the row, used to split up rasterization
+	  @param x X-axis coord. for start of key
+	  @param y Y-axis coord. for start of key
+	  @param width Width of key
+	  @param height Height of key
 	  @param cap Key cap
 	  @param key Key text
-	  @param padding Spacing to reserve around the key
-	  @param font Font to use for key character
-	  @param isHighlighted Whether the drawing is for the highlighted keys
+	  @param action What pressing the key does
 	  @param isPreviewEnabled Whether this key will show a preview on press
-	  @param foreground Foreground color for the keycap
-	  @param background Background color for the keycap
+	  @param style Background style for the key
 	  */
-	void drawKey(SDL_Surface *surface, std::vector<touchArea> &keyVector, int x, int y,
-		int width, int height, char *cap, const char *key, int padding, TTF_Font *font, bool isHighlighted,
-		bool isPreviewEnabled, argb foreground, argb background) const;
+	void layoutKey(KeyboardLayer *layer, int row, int x, int y, int width, int height, const char *cap,
+		const char *key, KeyAction action, bool isPreviewEnabled, KeyStyle style);
 	/**
-	  Prepare new keyboard surface
+	  Compute position and look of all keys of a layer, filling in keyVector, keyCaps and keyGrid
 	  @param layer Keyboard layer to use
-	  @param isHighlighted Whether the drawing is for the highlighted keys
+	  */
+	void layoutKeyboard(KeyboardLayer *layer);
+	/**
+	  Fill in the grid of a layer that getKeyForCoordinates() looks keys up in
+	  @param layer Keyboard layer to use, its keys must be laid out already
+	  @param rowHeight Height of a key row
+	  */
+	void buildKeyGrid(KeyboardLayer *layer, int rowHeight) const;
+	/**
+	  Get the ID of a key text, adding it to keyTexts if it is new
+	  @param text Key text
+	  @return Index of the text in keyTexts
+	  */
+	uint16_t internKeyText(const char *text);
+	/**
+	  Prepare new, empty keyboard surface
 	  @return New SDL_Surface, or nullptr on error
 	  */
-	SDL_Surface *makeKeyboard(KeyboardLayer *layer, bool isHighlighted) const;
+	SDL_Surface *makeKeyboardSurface() const;
 	/**
-	  Prepare new keyboard texture
-	  @param renderer Initialized SDL_Renderer object
+	  Draw all keys of one row of a layer. Rows occupy distinct parts of the surface, so different rows of the
+	  same surface can be drawn from different threads as long as each thread uses its own font.
+	  @param surface Surface to draw on, as returned by makeKeyboardSurface
 	  @param layer Keyboard layer to use
-	  @param isHighlighted Whether the drawing is for the highlighted keys
-	  @return New SDL_Surface, or nullptr on error
+	  @param row Index of the row to draw
+	  @param font Font to use for key caps
+	  @return 0 on success, non-zero on error
+	  */
+	int drawKeys(SDL_Surface *surface, const KeyboardLayer &layer, int row, TTF_Font *font) const;
+	/**
+	  Queue rasterization of a layer on the worker pool, unless it was queued already
+	  @param layer Keyboard layer to rasterize
+	  */
+	void queueLayer(KeyboardLayer &layer);
+	/**
+	  Upload a layer as texture, rasterizing it first if that did not happen in the background yet
+	  @param layer Keyboard layer to upload
+	  @return 0 on success, non-zero on error
+	  */
+	int uploadLayer(KeyboardLayer &layer);
+	/**
+	  Free the surface of a layer
+	  @param layer Keyboard layer to use
+	  */
+	void freeSurface(KeyboardLayer &layer);
+	/**
+	  Write all rasterized layers to the cache file. Called from the worker that finishes the last layer.
+	  */
+	void writeCache();
+	/**
+	  Draw the key caps of all layers into the glyph atlas. The atlas draws the highlighted key, and with
+	  keyboard-renderer set to atlas also all other keys.
+	  @return 0 on success, non-zero on error
+	  */
+	int initAtlas();
+	/**
+	  Queue drawing a highlighted key and its preview on the glyph atlas
+	  @param index Index of the key in the active layer
+	  @param offsetY Y-axis coord. of the top of the keyboard on screen
+	  */
+	void drawHighlightedKey(int index, int offsetY);
+	/**
+	  Find the press of a pointer that was not released yet
+	  @param pointerId Finger ID of the touch, or MOUSE_POINTER_ID
+	  @return Iterator to the press, or the end of keyPresses if there is none
 	  */
-	SDL_Texture *makeKeyboardTexture(SDL_Renderer *renderer, KeyboardLayer *layer, bool isHighlighted) const;
+	std::vector<KeyPress>::iterator findKeyPress(int64_t pointerId);
 	/**
 	  Load a keymap into the keyboard
 	  */
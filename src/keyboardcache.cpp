@@ -0,0 +1,262 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "keyboardcache.h"
+#include "fontmanager.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char CACHE_MAGIC[8] = { 'O', 'S', 'K', 'K', 'B', 'D', 'C', '\0' };
+constexpr uint32_t CACHE_FORMAT_VERSION = 2;
+constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t formatVersion;
+	uint32_t layerCount;
+	uint64_t key;
+	uint32_t width;
+	uint32_t height;
+	uint64_t pixelsOffset;
+	uint64_t pixelsSize;
+	uint64_t checksum;
+};
+
+/*
+ * FNV-1a, but mixing in whole 64-bit words where possible since the cache holds megabytes of pixels that are
+ * checked on every boot
+ */
+static uint64_t hashBytes(const void *data, size_t len, uint64_t hash = FNV_OFFSET)
+{
+	const auto bytes = static_cast<const uint8_t *>(data);
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * FNV_PRIME;
+	}
+	for (; i < len; i++) {
+		hash = (hash ^ bytes[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+static size_t alignUp(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static bool writeAll(int fd, const void *data, size_t len)
+{
+	auto bytes = static_cast<const uint8_t *>(data);
+	while (len > 0) {
+		ssize_t written = write(fd, bytes, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		bytes += written;
+		len -= written;
+	}
+	return true;
+}
+
+KeyboardCache::~KeyboardCache()
+{
+	unmap();
+}
+
+void KeyboardCache::unmap()
+{
+	if (data) {
+		munmap(data, size);
+		data = nullptr;
+		size = 0;
+	}
+}
+
+uint64_t KeyboardCache::makeKey(const Config &config, int width, int height, int keyRadius)
+{
+	std::ostringstream params;
+	for (const auto &color : { config.keyboardBackground, config.keyForeground, config.keyBackgroundLetter,
+			 config.keyBackgroundReturn, config.keyBackgroundOther }) {
+		params << static_cast<int>(color.a) << "," << static_cast<int>(color.r) << ","
+			   << static_cast<int>(color.g) << "," << static_cast<int>(color.b) << ";";
+	}
+	params << VERSION << ";" << CACHE_FORMAT_VERSION << ";" << SDL_BYTEORDER << ";" << width << "x" << height
+		   << ";" << keyRadius << ";" << config.keyboardFont << ";" << config.keyboardFontSize << ";"
+		   << config.keyboardMap << ";" << config.keyPreview;
+	const std::string paramString = params.str();
+	uint64_t key = hashBytes(paramString.data(), paramString.size());
+
+	// The font file itself, since it may be replaced without changing its path
+	size_t fontSize;
+	const void *font = FontManager::getData(config.keyboardFont, &fontSize);
+	return hashBytes(font, fontSize, key);
+}
+
+bool KeyboardCache::load(uint64_t key, int width, int height, size_t layerCount)
+{
+	unmap();
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "No keyboard cache at %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CacheHeader)) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Keyboard cache %s is truncated", path.c_str());
+		close(fd);
+		return false;
+	}
+	// Private mapping, so the surfaces can be handed to SDL without any risk of modifying the file
+	void *mapped = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Unable to map keyboard cache %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	data = static_cast<uint8_t *>(mapped);
+	size = st.st_size;
+
+	CacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	size_t surfaceSize = static_cast<size_t>(width) * height * 4;
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+		|| header.formatVersion != CACHE_FORMAT_VERSION) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Keyboard cache %s has an unknown format", path.c_str());
+		unmap();
+		return false;
+	}
+	if (header.key != key || header.width != static_cast<uint32_t>(width)
+		|| header.height != static_cast<uint32_t>(height) || header.layerCount != layerCount) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Keyboard cache %s is stale", path.c_str());
+		unmap();
+		return false;
+	}
+	if (header.pixelsOffset < sizeof(CacheHeader) || header.pixelsSize != surfaceSize * layerCount
+		|| header.pixelsOffset + header.pixelsSize != size) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Keyboard cache %s is corrupt: bad layout", path.c_str());
+		unmap();
+		return false;
+	}
+
+	uint64_t checksum = FNV_OFFSET;
+	for (size_t i = 0; i < layerCount; i++) {
+		checksum = hashBytes(data + header.pixelsOffset + i * surfaceSize, surfaceSize, checksum);
+	}
+	if (checksum != header.checksum) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Keyboard cache %s is corrupt: checksum mismatch", path.c_str());
+		unmap();
+		return false;
+	}
+
+	this->width = width;
+	this->height = height;
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Using keyboard cache %s", path.c_str());
+	return true;
+}
+
+SDL_Surface *KeyboardCache::getSurface(size_t layer) const
+{
+	Uint32 rmask, gmask, bmask;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+	rmask = 0xff000000;
+	gmask = 0x00ff0000;
+	bmask = 0x0000ff00;
+#else
+	rmask = 0x000000ff;
+	gmask = 0x0000ff00;
+	bmask = 0x00ff0000;
+#endif
+	CacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	size_t surfaceSize = static_cast<size_t>(width) * height * 4;
+	uint8_t *pixels = data + header.pixelsOffset + layer * surfaceSize;
+	SDL_Surface *surface = SDL_CreateRGBSurfaceFrom(pixels, width, height, 32, width * 4, rmask, gmask, bmask, 0);
+	if (!surface) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "CreateRGBSurfaceFrom failed: %s", SDL_GetError());
+	}
+	return surface;
+}
+
+bool KeyboardCache::save(uint64_t key, const std::vector<KeyboardLayer> &layers) const
+{
+	if (layers.empty() || !layers[0].surface) {
+		return false;
+	}
+	int surfaceWidth = layers[0].surface->w;
+	int surfaceHeight = layers[0].surface->h;
+	size_t surfaceSize = static_cast<size_t>(surfaceWidth) * surfaceHeight * 4;
+
+	CacheHeader header = {};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.formatVersion = CACHE_FORMAT_VERSION;
+	header.layerCount = layers.size();
+	header.key = key;
+	header.width = surfaceWidth;
+	header.height = surfaceHeight;
+	header.pixelsOffset = alignUp(sizeof(CacheHeader), 64);
+	header.pixelsSize = surfaceSize * layers.size();
+	header.checksum = FNV_OFFSET;
+
+	std::string tmpPath = path + ".tmp";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Unable to create keyboard cache %s: %s", tmpPath.c_str(),
+			strerror(errno));
+		return false;
+	}
+
+	// Header is written last, once the checksum is known
+	bool ok = lseek(fd, header.pixelsOffset, SEEK_SET) >= 0;
+	std::vector<uint8_t> pixels(surfaceSize);
+	for (const auto &layer : layers) {
+		SDL_Surface *surface = layer.surface;
+		if (!ok || !surface || surface->w != surfaceWidth || surface->h != surfaceHeight
+			|| surface->format->BytesPerPixel != 4) {
+			ok = false;
+			break;
+		}
+		const auto src = static_cast<const uint8_t *>(surface->pixels);
+		for (int y = 0; y < surfaceHeight; y++) {
+			memcpy(pixels.data() + y * surfaceWidth * 4, src + y * surface->pitch, surfaceWidth * 4);
+		}
+		header.checksum = hashBytes(pixels.data(), pixels.size(), header.checksum);
+		ok = writeAll(fd, pixels.data(), pixels.size());
+	}
+	ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO, "Unable to write keyboard cache %s: %s", path.c_str(), strerror(errno));
+		unlink(tmpPath.c_str());
+		return false;
+	}
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Wrote keyboard cache %s", path.c_str());
+	return true;
+}
@@ -0,0 +1,93 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEYBOARDCACHE_H
+#define KEYBOARDCACHE_H
+#include "config.h"
+#include "keyboard.h"
+#include <SDL2/SDL.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Cache file with the rasterized keyboard layers, so they don't have to be drawn again on every boot. The file is
+ * mapped into memory and the surfaces handed out point directly into the mapping.
+ */
+class KeyboardCache {
+public:
+	/**
+	  Constructor
+	  @param path Location of the cache file
+	  */
+	explicit KeyboardCache(const std::string &path)
+		: path(path)
+	{
+	}
+	/**
+	  Unmap the cache file. Surfaces returned by getSurface() must be freed before this.
+	  */
+	~KeyboardCache();
+	KeyboardCache(const KeyboardCache &) = delete;
+	KeyboardCache &operator=(const KeyboardCache &) = delete;
+	/**
+	  Compute the key identifying keyboard surfaces drawn with the given parameters
+	  @param config Config used for drawing
+	  @param width Width of the keyboard
+	  @param height Height of the keyboard
+	  @param keyRadius Key radius used for drawing
+	  @return Hash of everything that influences the keyboard pixels
+	  */
+	static uint64_t makeKey(const Config &config, int width, int height, int keyRadius);
+	/**
+	  Map and validate the cache file
+	  @param key Expected key, from makeKey()
+	  @param width Expected width of the surfaces
+	  @param height Expected height of the surfaces
+	  @param layerCount Expected number of layers
+	  @return true if the cache file is valid and matches, false otherwise
+	  */
+	bool load(uint64_t key, int width, int height, size_t layerCount);
+	/**
+	  Get a surface pointing into the mapped cache file. Only valid after load() succeeded.
+	  @param layer Index of the layer
+	  @return New SDL_Surface, or nullptr on error
+	  */
+	SDL_Surface *getSurface(size_t layer) const;
+	/**
+	  Write a new cache file, replacing the existing one
+	  @param key Key of the surfaces, from makeKey()
+	  @param layers Fully rasterized layers, with surface set
+	  @return true on success, false otherwise
+	  */
+	bool save(uint64_t key, const std::vector<KeyboardLayer> &layers) const;
+
+private:
+	std::string path;
+	uint8_t *data = nullptr;
+	size_t size = 0;
+	int width = 0;
+	int height = 0;
+
+	/**
+	  Unmap the cache file if it is mapped
+	  */
+	void unmap();
+};
+#endif
@@ -0,0 +1,47 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "keyring.h"
+#include <SDL2/SDL.h>
+#include <cerrno>
+#include <cstring>
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int addPassphraseToKeyring(const std::string &description, const Passphrase &passphrase, unsigned timeout)
+{
+	// There is no glibc wrapper, and libkeyutils is not worth a dependency for two calls
+	long key = syscall(SYS_add_key, "user", description.c_str(), passphrase.data(), passphrase.size(),
+		KEY_SPEC_USER_KEYRING);
+	if (key < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to add key %s to the user keyring: %s", description.c_str(),
+			strerror(errno));
+		return 1;
+	}
+	if (timeout > 0 && syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, key, timeout) < 0) {
+		// A key that never expires is worse than none
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to set timeout of key %s: %s", description.c_str(),
+			strerror(errno));
+		syscall(SYS_keyctl, KEYCTL_UNLINK, key, KEY_SPEC_USER_KEYRING);
+		return 1;
+	}
+	SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Added key %s to the user keyring", description.c_str());
+	return 0;
+}
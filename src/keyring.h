@@ -0,0 +1,34 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEYRING_H
+#define KEYRING_H
+#include "passphrase.h"
+#include <string>
+
+/**
+  Store a passphrase as a "user" key in the kernel user keyring, so that later boot steps can read it with keyctl
+  instead of asking again
+  @param description Description of the key, later steps look the key up by it
+  @param passphrase Passphrase to store
+  @param timeout Seconds after which the kernel removes the key, 0 to keep it until it is removed explicitly
+  @return 0 on success, non-zero on failure
+  */
+int addPassphraseToKeyring(const std::string &description, const Passphrase &passphrase, unsigned timeout);
+#endif
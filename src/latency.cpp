@@ -0,0 +1,132 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+#include <SDL2/SDL_thread.h>
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <pthread.h>
+
+static Uint32 signalEventType;
+
+int LatencyHistogram::bucketIndex(uint64_t micros)
+{
+	if (micros < LATENCY_SUB_BUCKETS) {
+		return static_cast<int>(micros);
+	}
+	// Position of the highest set bit, and the bits right below it pick the sub-bucket
+	int exponent = 63 - __builtin_clzll(micros);
+	int shift = exponent - 2;
+	int index = LATENCY_SUB_BUCKETS + shift * LATENCY_SUB_BUCKETS
+		+ static_cast<int>((micros >> shift) & (LATENCY_SUB_BUCKETS - 1));
+	return std::min(index, LATENCY_BUCKETS - 1);
+}
+
+uint64_t LatencyHistogram::bucketStart(int index)
+{
+	if (index < LATENCY_SUB_BUCKETS) {
+		return index;
+	}
+	int shift = index / LATENCY_SUB_BUCKETS - 1;
+	uint64_t sub = index % LATENCY_SUB_BUCKETS;
+	return (LATENCY_SUB_BUCKETS + sub) << shift;
+}
+
+void LatencyHistogram::record(uint64_t micros)
+{
+	buckets[bucketIndex(micros)]++;
+	count++;
+	sum += micros;
+	min = std::min(min, micros);
+	max = std::max(max, micros);
+}
+
+uint64_t LatencyHistogram::getPercentile(double percentile) const
+{
+	if (count == 0) {
+		return 0;
+	}
+	auto target = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(count)));
+	target = std::max<uint64_t>(target, 1);
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= target) {
+			// The true value can't be above the largest sample
+			return std::min(bucketStart(i + 1) - 1, max);
+		}
+	}
+	return max;
+}
+
+void LatencyHistogram::dump(const char *name) const
+{
+	if (count == 0) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s: no samples", name);
+		return;
+	}
+	SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+		"%s: %llu samples, min %.1f ms, mean %.1f ms, p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms", name,
+		static_cast<unsigned long long>(count), min / 1000.0, static_cast<double>(sum) / count / 1000.0,
+		getPercentile(50) / 1000.0, getPercentile(95) / 1000.0, getPercentile(99) / 1000.0, max / 1000.0);
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		if (buckets[i]) {
+			SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s: %8.1f - %8.1f ms: %llu", name, bucketStart(i) / 1000.0,
+				bucketStart(i + 1) / 1000.0, static_cast<unsigned long long>(buckets[i]));
+		}
+	}
+}
+
+static int signalWaiter(void *data)
+{
+	auto signals = static_cast<sigset_t *>(data);
+	SDL_Event event = {};
+	event.type = signalEventType;
+	while (true) {
+		int signal;
+		if (sigwait(signals, &signal) == 0) {
+			SDL_PushEvent(&event);
+		}
+	}
+	return 0;
+}
+
+int LatencyHistogram::watchSignal(Uint32 eventType)
+{
+	static sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	// Threads started from now on inherit the mask, so only the waiter thread ever sees the signal
+	int ret = pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	if (ret != 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to block SIGUSR1: %s", strerror(ret));
+		return 1;
+	}
+	signalEventType = eventType;
+	SDL_Thread *thread = SDL_CreateThread(signalWaiter, "osk_sigusr1", &signals);
+	if (!thread) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to start signal thread: %s", SDL_GetError());
+		pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+		return 1;
+	}
+	SDL_DetachThread(thread);
+	return 0;
+}
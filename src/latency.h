@@ -0,0 +1,85 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <SDL2/SDL.h>
+#include <array>
+#include <cstdint>
+
+// Values below this are counted exactly, above it every power of two is split into this many buckets
+constexpr int LATENCY_SUB_BUCKETS = 4;
+constexpr int LATENCY_BUCKETS = LATENCY_SUB_BUCKETS * 40;
+
+/*
+ * Histogram of latencies in microseconds, with logarithmically sized buckets so that it stays small while the
+ * relative error of the reported percentiles is bounded
+ */
+class LatencyHistogram {
+public:
+	/**
+	  Add a sample
+	  @param micros Latency in microseconds
+	  */
+	void record(uint64_t micros);
+	/**
+	  Get a percentile of all samples. The result is the upper bound of the bucket the percentile falls into.
+	  @param percentile Percentile, between 0 and 100
+	  @return Latency in microseconds, or 0 if there are no samples
+	  */
+	uint64_t getPercentile(double percentile) const;
+	/**
+	  Get the number of samples
+	  @return Number of samples
+	  */
+	uint64_t getCount() const { return count; };
+	/**
+	  Log a summary and all non-empty buckets
+	  @param name Name of the histogram for the log
+	  */
+	void dump(const char *name) const;
+	/**
+	  Push an SDL event of the given type whenever the process receives SIGUSR1. Must be called before any other
+	  thread is started, so that they all inherit the blocked signal.
+	  @param eventType SDL_EventType to push
+	  @return 0 on success, non-zero on error
+	  */
+	static int watchSignal(Uint32 eventType);
+
+private:
+	std::array<uint64_t, LATENCY_BUCKETS> buckets = {};
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+
+	/**
+	  Get the bucket a value is counted in
+	  @param micros Latency in microseconds
+	  @return Index of the bucket
+	  */
+	static int bucketIndex(uint64_t micros);
+	/**
+	  Get the smallest value counted in a bucket
+	  @param index Index of the bucket
+	  @return Latency in microseconds
+	  */
+	static uint64_t bucketStart(int index);
+};
+#endif
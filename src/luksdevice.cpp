@@ -18,71 +18,762 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include "luksdevice.h"
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
 
-int LuksDevice::unlock()
+// Time the KDF calibration aims for, a compromise between its accuracy and how much it slows down typing
+constexpr Uint32 KDF_CALIBRATION_MS = 100;
+// Memory the Argon2 calibration runs with at most. The cost of a run grows about linearly with its memory, and
+// allocating all of it for a big keyslot could take longer than the calibration itself.
+constexpr uint32_t KDF_CALIBRATION_MAX_MEMORY_KB = 64 * 1024;
+// Upper limits for tuned Argon2 keyslots, the same as the cryptsetup defaults
+constexpr uint32_t TUNE_MAX_MEMORY_KB = 1024 * 1024;
+constexpr uint32_t TUNE_MAX_THREADS = 4;
+
+static double millisecondsSince(Uint64 start)
 {
-	SDL_CreateThread(unlock, "lukscryptdevice_unlock", this);
-	return 0;
+	return static_cast<double>(SDL_GetPerformanceCounter() - start) * 1000.0
+		/ static_cast<double>(SDL_GetPerformanceFrequency());
 }
 
-int LuksDevice::unlock(void *luksDev)
+LuksDevice::~LuksDevice()
+{
+	cancel();
+	waitForUnlock();
+	waitForPrefetch();
+	if (cd) {
+		crypt_free(cd);
+		cd = nullptr;
+	}
+	if (mutex) {
+		SDL_DestroyMutex(mutex);
+		mutex = nullptr;
+	}
+}
+
+void LuksDevice::prefetch()
+{
+	if (!mutex) {
+		// Nothing to guard the thread with, the header is loaded by the unlock attempt instead
+		return;
+	}
+	SDL_LockMutex(mutex);
+	if (!prefetchThread && !cd) {
+		prefetchThread = SDL_CreateThread(prefetch, "lukscryptdevice_prefetch", this);
+		if (!prefetchThread) {
+			SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to start header prefetch: %s", SDL_GetError());
+		}
+	}
+	SDL_UnlockMutex(mutex);
+}
+
+int LuksDevice::prefetch(void *luksDev)
 {
-	struct crypt_device *cd;
-	int ret = 0;
 	const auto lcd = static_cast<LuksDevice *>(luksDev);
-	SDL_Event event = {
-		.type = lcd->eventType
+	Trace::setThreadName("lukscryptdevice_prefetch");
+	int ret = lcd->loadHeader();
+	// Runs while the passphrase is typed, so the unlock attempt can show how long it will take. Once an attempt
+	// started, it waits for this thread, and a time estimate isn't worth delaying the KDF for.
+	if (ret == 0 && lcd->getState() != UnlockState::unlocking) {
+		lcd->calibrate();
+	}
+	return ret;
+}
+
+void LuksDevice::waitForPrefetch()
+{
+	if (!mutex) {
+		return;
+	}
+	SDL_LockMutex(mutex);
+	if (prefetchThread) {
+		SDL_WaitThread(prefetchThread, nullptr);
+		prefetchThread = nullptr;
+	}
+	SDL_UnlockMutex(mutex);
+}
+
+int LuksDevice::loadHeader()
+{
+	if (cd) {
+		return 0;
+	}
+	SDL_AtomicSet(&headerStatus, static_cast<int>(HeaderStatus::pending));
+
+	// Initialize crypt device
+	Uint64 start = SDL_GetPerformanceCounter();
+	int ret = traceCall("crypt_init", [&] { return crypt_init(&cd, devicePath.c_str()); });
+	timings.init = millisecondsSince(start);
+	if (ret < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "crypt_init() failed for %s.", devicePath.c_str());
+		cd = nullptr;
+		SDL_AtomicSet(&headerStatus, static_cast<int>(HeaderStatus::missingDevice));
+		return ret;
+	}
+
+	// Load header
+	start = SDL_GetPerformanceCounter();
+	ret = traceCall("crypt_load", [&] { return crypt_load(cd, nullptr, nullptr); });
+	timings.load = millisecondsSince(start);
+	if (ret < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "crypt_load() failed on device %s.", crypt_get_device_name(cd));
+		crypt_free(cd);
+		cd = nullptr;
+		SDL_AtomicSet(&headerStatus, static_cast<int>(HeaderStatus::badHeader));
+		return ret;
+	}
+	SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Loaded luks header of %s", devicePath.c_str());
+	SDL_AtomicSet(&headerStatus, static_cast<int>(HeaderStatus::loaded));
+	return 0;
+}
+
+int LuksDevice::readKeyslotHint(Uint32 &duration) const
+{
+	duration = 0;
+	if (keyslotCache.empty()) {
+		return -1;
+	}
+	const char *uuid = crypt_get_uuid(cd);
+	std::ifstream is(keyslotCache);
+	std::string line;
+	while (uuid && std::getline(is, line)) {
+		std::istringstream fields(line);
+		std::string lineUuid;
+		int keyslot;
+		if (fields >> lineUuid >> keyslot && lineUuid == uuid) {
+			// Files written by older versions have no duration
+			if (!(fields >> duration)) {
+				duration = 0;
+			}
+			return keyslot;
+		}
+	}
+	return -1;
+}
+
+void LuksDevice::writeKeyslotHint(int keyslot, Uint32 duration) const
+{
+	const char *uuid = crypt_get_uuid(cd);
+	if (keyslotCache.empty() || !uuid) {
+		return;
+	}
+
+	// Other devices unlocking at the same time rewrite the same file
+	if (keyslotCacheLock) {
+		SDL_LockMutex(keyslotCacheLock);
+	}
+	// Keep the entries of other devices
+	std::ostringstream contents;
+	std::ifstream is(keyslotCache);
+	std::string line;
+	while (std::getline(is, line)) {
+		std::istringstream fields(line);
+		std::string lineUuid;
+		if (fields >> lineUuid && lineUuid != uuid) {
+			contents << line << "\n";
+		}
+	}
+	is.close();
+	contents << uuid << " " << keyslot << " " << duration << "\n";
+
+	// A name of its own, so that a second osk-sdl, e.g. one left over from an earlier stage, can't write to it
+	std::string tmpPath = keyslotCache + ".XXXXXX";
+	int fd = mkstemp(tmpPath.data());
+	bool written = false;
+	if (fd >= 0) {
+		close(fd);
+		std::ofstream os(tmpPath, std::ofstream::trunc);
+		os << contents.str();
+		os.close();
+		written = os && rename(tmpPath.c_str(), keyslotCache.c_str()) == 0;
+	}
+	if (!written) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to write keyslot cache %s: %s", keyslotCache.c_str(),
+			strerror(errno));
+		if (fd >= 0) {
+			unlink(tmpPath.c_str());
+		}
+	}
+	if (keyslotCacheLock) {
+		SDL_UnlockMutex(keyslotCacheLock);
+	}
+}
+
+// Cost of a KDF run in the units calibrate() measures, or 0 if unknown
+static double getKdfCost(const struct crypt_pbkdf_type &pbkdf)
+{
+	return static_cast<double>(pbkdf.iterations) * std::max<uint32_t>(pbkdf.max_memory_kb, 1);
+}
+
+void LuksDevice::calibrate()
+{
+	Uint32 duration;
+	int hint = readKeyslotHint(duration);
+	if (duration > 0) {
+		// The measurement from the last unlock is better than any calibration
+		return;
+	}
+	std::vector<int> order = getKeyslotOrder(hint);
+	struct crypt_pbkdf_type pbkdf = {};
+	if (order.empty() || crypt_keyslot_get_pbkdf(cd, order.front(), &pbkdf) != 0 || !pbkdf.type) {
+		return;
+	}
+	TRACE_SCOPE("LuksDevice::calibrate");
+	// libcryptsetup finds the iterations that take KDF_CALIBRATION_MS with the same threads as the keyslot, and at
+	// most its memory, by running the KDF with small parameters and extrapolating
+	struct crypt_pbkdf_type benchmark = pbkdf;
+	benchmark.iterations = 0;
+	benchmark.time_ms = KDF_CALIBRATION_MS;
+	benchmark.flags = 0;
+	if (benchmark.max_memory_kb > KDF_CALIBRATION_MAX_MEMORY_KB) {
+		benchmark.max_memory_kb = KDF_CALIBRATION_MAX_MEMORY_KB;
+	}
+	const char password[] = "osk-sdl";
+	const char salt[] = "0123456789abcdef0123456789abcdef";
+	int ret = crypt_benchmark_pbkdf(cd, &benchmark, password, sizeof(password) - 1, salt, sizeof(salt) - 1,
+		crypt_get_volume_key_size(cd), nullptr, nullptr);
+	if (ret < 0 || getKdfCost(benchmark) <= 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to calibrate %s: %s", pbkdf.type, strerror(-ret));
+		return;
+	}
+	calibratedKdf = pbkdf.type;
+	msPerCost = KDF_CALIBRATION_MS / getKdfCost(benchmark);
+	SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Calibrated %s: %u iterations with %u KiB take %u ms", pbkdf.type,
+		benchmark.iterations, benchmark.max_memory_kb, KDF_CALIBRATION_MS);
+}
+
+Uint32 LuksDevice::estimateKdfDuration(int keyslot, int hint, Uint32 hintDuration) const
+{
+	if (keyslot == hint && hintDuration > 0) {
+		return hintDuration;
+	}
+	struct crypt_pbkdf_type pbkdf = {};
+	if (msPerCost <= 0 || crypt_keyslot_get_pbkdf(cd, keyslot, &pbkdf) != 0 || !pbkdf.type
+		|| calibratedKdf != pbkdf.type) {
+		return 0;
+	}
+	return static_cast<Uint32>(getKdfCost(pbkdf) * msPerCost);
+}
+
+bool LuksDevice::getUnlockProgress(Uint32 &elapsed, Uint32 &estimate) const
+{
+	estimate = static_cast<Uint32>(SDL_AtomicGet(&kdfEstimate));
+	if (!unlockRunning() || estimate == 0) {
+		return false;
+	}
+	elapsed = SDL_GetTicks() - static_cast<Uint32>(SDL_AtomicGet(&kdfStart));
+	return true;
+}
+
+void LuksDevice::setKdfEstimate(Uint32 estimate)
+{
+	SDL_AtomicSet(&kdfStart, static_cast<int>(SDL_GetTicks()));
+	SDL_AtomicSet(&kdfEstimate, static_cast<int>(estimate));
+}
+
+std::vector<int> LuksDevice::getKeyslotOrder(int hint) const
+{
+	struct Keyslot {
+		int number;
+		double cost;
 	};
+	std::vector<Keyslot> keyslots;
+	int max = crypt_keyslot_max(crypt_get_type(cd));
+	for (int i = 0; i < max; i++) {
+		crypt_keyslot_info info = crypt_keyslot_status(cd, i);
+		if (info != CRYPT_SLOT_ACTIVE && info != CRYPT_SLOT_ACTIVE_LAST) {
+			continue;
+		}
+		// Rough estimate of the KDF run time: Argon2 touches its memory once per iteration, and a million
+		// PBKDF2 iterations take about as long as a pass over a GiB of memory
+		double cost = 0;
+		struct crypt_pbkdf_type pbkdf = {};
+		if (crypt_keyslot_get_pbkdf(cd, i, &pbkdf) == 0) {
+			cost = pbkdf.iterations;
+			if (pbkdf.max_memory_kb > 0) {
+				cost *= pbkdf.max_memory_kb;
+			}
+		}
+		if (i == hint) {
+			cost = -1;
+		}
+		SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Keyslot %d: %s, %u iterations, %u KiB, %u threads%s", i,
+			pbkdf.type ? pbkdf.type : "unknown KDF", pbkdf.iterations, pbkdf.max_memory_kb, pbkdf.parallel_threads,
+			i == hint ? ", last used" : "");
+		keyslots.push_back({ i, cost });
+	}
+	std::stable_sort(keyslots.begin(), keyslots.end(),
+		[](const Keyslot &a, const Keyslot &b) { return a.cost < b.cost; });
+
+	std::vector<int> order;
+	for (const auto &keyslot : keyslots) {
+		order.push_back(keyslot.number);
+	}
+	return order;
+}
+
+/*
+ * State shared between the threads of a parallel keyslot trial. Threads that are still running a KDF when another
+ * one found the key can't be interrupted, they drop their result when done and are joined before the trial ends, so
+ * that the next attempt doesn't start with their memory still in use.
+ */
+struct KeyslotTrial {
+	std::string devicePath;
+	Passphrase passphrase;
+	std::vector<int> keyslots;
+	SDL_mutex *mutex = nullptr;
+	SDL_cond *finished = nullptr;
+	size_t next = 0;
+	int running = 0;
+	int winner = -1;
+	int error = -EPERM;
+	std::vector<char> volumeKey;
 
-	uint32_t flags = CRYPT_ACTIVATE_ALLOW_DISCARDS; // Enable TRIM support
+	~KeyslotTrial()
+	{
+		explicit_bzero(volumeKey.data(), volumeKey.size());
+		SDL_DestroyCond(finished);
+		SDL_DestroyMutex(mutex);
+	}
+};
 
-	// If supported by libcryptsetup (2.3.4 and above), disable read/write workqueues
-	// for performance on SSDs
 #ifdef CRYPT_ACTIVATE_NO_READ_WORKQUEUE
-	flags |= CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
+constexpr uint32_t NO_READ_WORKQUEUE = CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
+#else
+constexpr uint32_t NO_READ_WORKQUEUE = 0;
 #endif
 #ifdef CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE
-	flags |= CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+constexpr uint32_t NO_WRITE_WORKQUEUE = CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+#else
+constexpr uint32_t NO_WRITE_WORKQUEUE = 0;
 #endif
 
-	// Note: no mutex here, since this function makes a blocking call later on.
-	// Careful!
-	lcd->running = true;
+static uint64_t getAvailableMemoryKb()
+{
+	std::ifstream is("/proc/meminfo");
+	std::string key;
+	uint64_t value;
+	while (is >> key >> value) {
+		if (key == "MemAvailable:") {
+			return value;
+		}
+		is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+	}
+	return 0;
+}
 
-	usleep(std::chrono::microseconds { MIN_UNLOCK_TIME }.count());
+static int runKeyslotTrial(void *data)
+{
+	const auto trial = static_cast<KeyslotTrial *>(data);
+	Trace::setThreadName("lukscryptdevice_keyslot");
 
-	// Initialize crypt device
-	ret = crypt_init(&cd, lcd->devicePath.c_str());
-	if (ret < 0) {
-		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "crypt_init() failed for %s.", lcd->devicePath.c_str());
-		goto DONE;
+	// libcryptsetup contexts can't be shared between threads, so every thread loads the header itself
+	struct crypt_device *cd = nullptr;
+	int ret = crypt_init(&cd, trial->devicePath.c_str());
+	if (ret >= 0) {
+		ret = crypt_load(cd, nullptr, nullptr);
 	}
+	std::vector<char> volumeKey(ret >= 0 ? crypt_get_volume_key_size(cd) : 0);
 
-	// Load header
-	ret = crypt_load(cd, nullptr, nullptr);
+	SDL_LockMutex(trial->mutex);
 	if (ret < 0) {
-		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "crypt_load() failed on device %s.", crypt_get_device_name(cd));
+		trial->error = ret;
+	}
+	while (ret >= 0 && trial->winner < 0 && trial->next < trial->keyslots.size()) {
+		int keyslot = trial->keyslots[trial->next++];
+		SDL_UnlockMutex(trial->mutex);
+
+		Uint64 start = SDL_GetPerformanceCounter();
+		size_t size = volumeKey.size();
+		int slotRet = traceCall("crypt_volume_key_get", [&] {
+			return crypt_volume_key_get(cd, keyslot, volumeKey.data(), &size, trial->passphrase.data(),
+				trial->passphrase.size());
+		});
+		SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Keyslot %d: %s after %.0f ms", keyslot,
+			slotRet >= 0 ? "unlocked" : "failed", millisecondsSince(start));
+
+		SDL_LockMutex(trial->mutex);
+		if (slotRet >= 0 && trial->winner < 0) {
+			trial->winner = slotRet;
+			trial->volumeKey.assign(volumeKey.begin(), volumeKey.begin() + size);
+		} else if (slotRet < 0 && slotRet != -EPERM) {
+			trial->error = slotRet;
+		}
+	}
+	trial->running--;
+	SDL_CondBroadcast(trial->finished);
+	SDL_UnlockMutex(trial->mutex);
+
+	explicit_bzero(volumeKey.data(), volumeKey.size());
+	if (cd) {
 		crypt_free(cd);
+	}
+	return 0;
+}
+
+int LuksDevice::getParallelTrialCount(const std::vector<int> &keyslots) const
+{
+	if (keyslots.size() < 2) {
+		return 1;
+	}
+	uint64_t maxMemoryKb = 0;
+	uint32_t maxThreads = 1;
+	for (int keyslot : keyslots) {
+		struct crypt_pbkdf_type pbkdf = {};
+		if (crypt_keyslot_get_pbkdf(cd, keyslot, &pbkdf) == 0) {
+			maxMemoryKb = std::max<uint64_t>(maxMemoryKb, pbkdf.max_memory_kb);
+			maxThreads = std::max(maxThreads, pbkdf.parallel_threads);
+		}
+	}
+
+	// Argon2 already spreads over parallel_threads CPUs, and every instance needs its memory for the whole run.
+	// A quarter of the available memory is left for the rest of the system.
+	int byCpu = std::max(1, SDL_GetCPUCount() / static_cast<int>(maxThreads));
+	int byMemory = static_cast<int>(keyslots.size());
+	uint64_t availableKb = getAvailableMemoryKb();
+	if (maxMemoryKb > 0 && availableKb > 0) {
+		byMemory = static_cast<int>(std::min<uint64_t>(availableKb / 4 * 3 / maxMemoryKb, keyslots.size()));
+	}
+	int count = std::max(1, std::min({ static_cast<int>(keyslots.size()), byCpu, byMemory }));
+	SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM,
+		"Trying %d of %zu keyslots at a time (%d CPUs, %u KDF threads, %llu KiB available, %llu KiB per KDF)", count,
+		keyslots.size(), SDL_GetCPUCount(), maxThreads, static_cast<unsigned long long>(availableKb),
+		static_cast<unsigned long long>(maxMemoryKb));
+	return count;
+}
+
+int LuksDevice::activateInParallel(const std::vector<int> &keyslots, int threadCount, uint32_t flags)
+{
+	auto trial = std::make_unique<KeyslotTrial>();
+	trial->devicePath = devicePath;
+	trial->passphrase.assign(attemptPassphrase);
+	trial->keyslots = keyslots;
+	trial->mutex = SDL_CreateMutex();
+	trial->finished = SDL_CreateCond();
+	if (!trial->mutex || !trial->finished) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to set up keyslot trial: %s", SDL_GetError());
+		return -ENOMEM;
+	}
+
+	std::vector<SDL_Thread *> threads;
+	SDL_LockMutex(trial->mutex);
+	for (int i = 0; i < threadCount; i++) {
+		SDL_Thread *thread = SDL_CreateThread(runKeyslotTrial, "lukscryptdevice_keyslot", trial.get());
+		if (!thread) {
+			SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to start keyslot thread: %s", SDL_GetError());
+			break;
+		}
+		threads.push_back(thread);
+		trial->running++;
+	}
+	if (trial->running == 0) {
+		SDL_UnlockMutex(trial->mutex);
+		return -ENOMEM;
+	}
+	// Wait for the first success, for all keyslots to fail, or for the attempt to be cancelled
+	while (trial->winner < 0 && trial->running > 0 && !isCancelled()) {
+		SDL_CondWaitTimeout(trial->finished, trial->mutex, 100);
+	}
+	int ret = trial->winner >= 0 ? trial->winner : trial->error;
+	if (trial->winner < 0 && trial->running > 0) {
+		// Threads still running finish their current keyslot and stop
+		trial->next = trial->keyslots.size();
+		ret = -ECANCELED;
+	}
+	std::vector<char> volumeKey;
+	volumeKey.swap(trial->volumeKey);
+	SDL_UnlockMutex(trial->mutex);
+
+	if (ret >= 0) {
+		int keyslot = ret;
+		ret = traceCall("crypt_activate_by_volume_key", [&] {
+			return crypt_activate_by_volume_key(cd, getActivationName(), volumeKey.data(), volumeKey.size(), flags);
+		});
+		if (ret >= 0) {
+			ret = keyslot;
+		}
+		explicit_bzero(volumeKey.data(), volumeKey.size());
+	}
+	// At most one KDF run each, they can't be interrupted
+	for (SDL_Thread *thread : threads) {
+		SDL_WaitThread(thread, nullptr);
+	}
+	return ret;
+}
+
+int LuksDevice::activateByKeyslot(uint32_t flags)
+{
+	Uint32 hintDuration;
+	int hint = readKeyslotHint(hintDuration);
+	std::vector<int> order = getKeyslotOrder(hint);
+	if (order.empty()) {
+		// Let libcryptsetup figure it out
+		order.push_back(CRYPT_ANY_SLOT);
+	}
+
+	int ret = -EPERM;
+	double duration = 0;
+	int threadCount = parallelKeyslots ? getParallelTrialCount(order) : 1;
+	if (threadCount > 1) {
+		// The keyslots that are tried first run at the same time, the slowest of them bounds the wait
+		Uint32 estimate = 0;
+		for (size_t i = 0; i < order.size() && i < static_cast<size_t>(threadCount); i++) {
+			estimate = std::max(estimate, estimateKdfDuration(order[i], hint, hintDuration));
+		}
+		setKdfEstimate(estimate);
+		Uint64 start = SDL_GetPerformanceCounter();
+		ret = activateInParallel(order, threadCount, flags);
+		duration = millisecondsSince(start);
+	} else {
+		for (int keyslot : order) {
+			if (isCancelled()) {
+				ret = -ECANCELED;
+				break;
+			}
+			Uint32 estimate = estimateKdfDuration(keyslot, hint, hintDuration);
+			if (estimate > 0) {
+				SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Keyslot %d: expecting about %u ms", keyslot, estimate);
+			}
+			setKdfEstimate(estimate);
+			Uint64 start = SDL_GetPerformanceCounter();
+			ret = traceCall("crypt_activate_by_passphrase", [&] {
+				return crypt_activate_by_passphrase(
+					cd, getActivationName(),
+					keyslot,
+					attemptPassphrase.data(),
+					attemptPassphrase.size(),
+					flags);
+			});
+			duration = millisecondsSince(start);
+			SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Keyslot %d: %s after %.0f ms", keyslot,
+				ret >= 0 ? "unlocked" : "failed", duration);
+			// Anything but a wrong passphrase won't get better with another keyslot
+			if (ret != -EPERM) {
+				break;
+			}
+		}
+	}
+	setKdfEstimate(0);
+	// Rewrite the keyslot cache only when the keyslot or its duration changed noticeably
+	if (ret >= 0 && (ret != hint || std::abs(duration - hintDuration) > hintDuration / 10.0)) {
+		writeKeyslotHint(ret, static_cast<Uint32>(duration));
+	}
+	return ret;
+}
+
+uint32_t LuksDevice::getActivationFlags(const Config &config)
+{
+	uint32_t flags = 0;
+	if (config.cryptAllowDiscards) {
+		flags |= CRYPT_ACTIVATE_ALLOW_DISCARDS; // Enable TRIM support
+	}
+	if (config.cryptSameCpuCrypt) {
+		flags |= CRYPT_ACTIVATE_SAME_CPU_CRYPT;
+	}
+	if (config.cryptSubmitFromCryptCpus) {
+		flags |= CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS;
+	}
+	// Only supported by libcryptsetup 2.3.4 and above
+	if (config.cryptNoReadWorkqueue) {
+		if (NO_READ_WORKQUEUE) {
+			flags |= NO_READ_WORKQUEUE;
+		} else {
+			SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "libcryptsetup is too old for crypt-no-read-workqueue, ignoring");
+		}
+	}
+	if (config.cryptNoWriteWorkqueue) {
+		if (NO_WRITE_WORKQUEUE) {
+			flags |= NO_WRITE_WORKQUEUE;
+		} else {
+			SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "libcryptsetup is too old for crypt-no-write-workqueue, ignoring");
+		}
+	}
+	return flags;
+}
+
+void LuksDevice::storeActivationFlags(uint32_t flags)
+{
+	const char *type = crypt_get_type(cd);
+	if (!type || strcmp(type, CRYPT_LUKS2) != 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Only LUKS2 headers can store activation flags, not storing them");
+		return;
+	}
+	uint32_t stored = 0;
+	if (crypt_persistent_flags_get(cd, CRYPT_FLAGS_ACTIVATION, &stored) == 0 && stored == flags) {
+		return;
+	}
+	int ret = crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, flags);
+	if (ret < 0) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to store activation flags in the header: %s", strerror(-ret));
+	} else {
+		SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Stored activation flags 0x%x in the header", flags);
+	}
+}
+
+int LuksDevice::tuneKdf(Uint32 targetMs)
+{
+	if (!passphrase) {
+		return -EINVAL;
+	}
+	int ret = loadHeader();
+	if (ret < 0) {
+		return ret;
+	}
+	// Without a name, this only checks the passphrase and activates nothing
+	int keyslot = crypt_activate_by_passphrase(cd, nullptr, CRYPT_ANY_SLOT, passphrase->data(), passphrase->size(), 0);
+	if (keyslot < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "The passphrase doesn't open any keyslot of %s", devicePath.c_str());
+		return keyslot;
+	}
+	struct crypt_pbkdf_type current = {};
+	ret = crypt_keyslot_get_pbkdf(cd, keyslot, &current);
+	if (ret < 0 || !current.type) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to read the KDF of keyslot %d", keyslot);
+		return ret < 0 ? ret : -EINVAL;
+	}
+
+	struct crypt_pbkdf_type tuned = current;
+	tuned.iterations = 0;
+	tuned.time_ms = targetMs;
+	tuned.flags = 0;
+	if (strcmp(current.type, CRYPT_KDF_PBKDF2) != 0) {
+		// Argon2 has to fit next to everything else running at boot. The benchmark lowers the memory further if
+		// even the minimum number of iterations takes too long.
+		uint64_t availableKb = getAvailableMemoryKb();
+		tuned.max_memory_kb = TUNE_MAX_MEMORY_KB;
+		if (availableKb > 0) {
+			tuned.max_memory_kb = static_cast<uint32_t>(std::min<uint64_t>(tuned.max_memory_kb, availableKb / 2));
+		}
+		tuned.parallel_threads = std::clamp<uint32_t>(SDL_GetCPUCount(), 1, TUNE_MAX_THREADS);
+	}
+	const char salt[] = "0123456789abcdef0123456789abcdef";
+	ret = traceCall("crypt_benchmark_pbkdf", [&] {
+		return crypt_benchmark_pbkdf(cd, &tuned, passphrase->data(), passphrase->size(), salt, sizeof(salt) - 1,
+			crypt_get_volume_key_size(cd), nullptr, nullptr);
+	});
+	if (ret < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to benchmark %s: %s", tuned.type, strerror(-ret));
+		return ret;
+	}
+
+	tuned.flags |= CRYPT_PBKDF_NO_BENCHMARK;
+	ret = crypt_set_pbkdf_type(cd, &tuned);
+	if (ret < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to set KDF parameters: %s", strerror(-ret));
+		return ret;
+	}
+	ret = traceCall("crypt_keyslot_change_by_passphrase", [&] {
+		return crypt_keyslot_change_by_passphrase(cd, keyslot, keyslot, passphrase->data(), passphrase->size(),
+			passphrase->data(), passphrase->size());
+	});
+	if (ret < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to re-encrypt keyslot %d: %s", keyslot, strerror(-ret));
+		return ret;
+	}
+	SDL_Log("Keyslot %d of %s now takes about %u ms: %s, %u -> %u iterations, %u -> %u KiB, %u -> %u threads", ret,
+		devicePath.c_str(), targetMs, tuned.type, current.iterations, tuned.iterations, current.max_memory_kb,
+		tuned.max_memory_kb, current.parallel_threads, tuned.parallel_threads);
+	return ret;
+}
+
+int LuksDevice::unlock()
+{
+	if (getState() != UnlockState::locked) {
+		return 1;
+	}
+	// The thread of the previous attempt has ended already, or is about to
+	waitForUnlock();
+	if (passphrase) {
+		attemptPassphrase.assign(*passphrase);
+	} else {
+		attemptPassphrase.clear();
+	}
+	SDL_AtomicSet(&cancelRequested, 0);
+	// Set before the thread starts, so the UI can't miss an attempt that fails right away
+	SDL_AtomicSet(&state, static_cast<int>(UnlockState::unlocking));
+	unlockThread = SDL_CreateThread(unlock, "lukscryptdevice_unlock", this);
+	if (!unlockThread) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to start unlock thread: %s", SDL_GetError());
+		SDL_AtomicSet(&state, static_cast<int>(UnlockState::locked));
+		return 1;
+	}
+	return 0;
+}
+
+void LuksDevice::cancel()
+{
+	SDL_AtomicSet(&cancelRequested, 1);
+}
+
+void LuksDevice::waitForUnlock()
+{
+	if (unlockThread) {
+		SDL_WaitThread(unlockThread, nullptr);
+		unlockThread = nullptr;
+	}
+}
+
+int LuksDevice::unlock(void *luksDev)
+{
+	int ret = 0;
+	Uint64 start;
+	const auto lcd = static_cast<LuksDevice *>(luksDev);
+	Trace::setThreadName("lukscryptdevice_unlock");
+	TRACE_SCOPE("LuksDevice::unlock");
+	SDL_Event event = {
+		.type = lcd->eventType
+	};
+
+	uint32_t flags = lcd->activationFlags;
+	SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Activating %s with flags 0x%x:%s%s%s%s%s", lcd->deviceName.c_str(), flags,
+		flags & CRYPT_ACTIVATE_ALLOW_DISCARDS ? " allow-discards" : "",
+		flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT ? " same-cpu-crypt" : "",
+		flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS ? " submit-from-crypt-cpus" : "",
+		flags & NO_READ_WORKQUEUE ? " no-read-workqueue" : "",
+		flags & NO_WRITE_WORKQUEUE ? " no-write-workqueue" : "");
+
+	// Normally the header was loaded in the background already. If that failed, e.g. because the device did not
+	// show up yet, try again.
+	lcd->waitForPrefetch();
+	ret = lcd->loadHeader();
+	if (ret < 0) {
 		goto DONE;
 	}
 
-	ret = crypt_activate_by_passphrase(
-		cd, lcd->deviceName.c_str(),
-		CRYPT_ANY_SLOT,
-		lcd->passphrase.c_str(),
-		lcd->passphrase.size(),
-		flags);
+	start = SDL_GetPerformanceCounter();
+	ret = lcd->activateByKeyslot(flags);
+	lcd->timings.kdf = millisecondsSince(start);
+	if (ret == -ECANCELED) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Unlock attempt of %s cancelled", lcd->devicePath.c_str());
+		goto DONE;
+	}
 	if (ret < 0) {
+		// The header stays loaded for the next attempt
 		SDL_Log("crypt_activate_by_passphrase failed on device. Errno %i", ret);
-		crypt_free(cd);
 		goto DONE;
 	}
 	SDL_Log("Successfully unlocked device %s", lcd->devicePath.c_str());
-	crypt_free(cd);
-	lcd->locked = false;
+	if (lcd->persistentFlags) {
+		lcd->storeActivationFlags(flags);
+	}
+	crypt_free(lcd->cd);
+	lcd->cd = nullptr;
 
 DONE:
+	lcd->attemptPassphrase.clear();
+	// Everything the UI reads after seeing the new state is written by now
+	SDL_AtomicAdd(&lcd->finishedAttempts, 1);
+	SDL_AtomicSet(&lcd->state, static_cast<int>(ret >= 0 ? UnlockState::unlocked : UnlockState::locked));
+	event.user.code = ret;
+	event.user.data1 = lcd;
 	SDL_PushEvent(&event);
-	lcd->running = false;
 	return ret;
 }
@@ -19,6 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #ifndef LUKSDEVICE_H
 #define LUKSDEVICE_H
+#include "config.h"
+#include "passphrase.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_thread.h>
 #include <chrono>
@@ -26,8 +28,27 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <libcryptsetup.h>
 #include <string>
 #include <unistd.h>
+#include <vector>
 
-constexpr std::chrono::milliseconds MIN_UNLOCK_TIME { 1000 };
+enum class HeaderStatus {
+	pending,
+	loaded,
+	missingDevice,
+	badHeader
+};
+
+// Duration of the phases of the last unlock attempt, in ms
+struct UnlockTimings {
+	double init = 0;
+	double load = 0;
+	double kdf = 0;
+};
+
+enum class UnlockState {
+	locked,
+	unlocking,
+	unlocked
+};
 
 class LuksDevice {
 public:
@@ -35,43 +56,255 @@ public:
 	  Constructor
 	  @param devName Name of luks device
 	  @param devPath Path to luks device
-	  @param eventType SDL_EventType to push after an unlock attempt
+	  @param eventType SDL_EventType to push after an unlock attempt. The event's user.code is the result of the
+	  attempt: the keyslot number on success, a negative errno on failure, -ECANCELED if it was cancelled. Its
+	  user.data1 points to the device.
 	  */
 	LuksDevice(std::string &devName, std::string &devPath, Uint32 eventType)
 		: deviceName(devName)
 		, devicePath(devPath)
 		, eventType(eventType)
 	{
+		mutex = SDL_CreateMutex();
+		if (!mutex) {
+			SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to create mutex for %s: %s", devPath.c_str(), SDL_GetError());
+		}
 	}
 	/**
-	  Unlock luks device
+	  Cancel a running unlock attempt, wait for it to end and free the loaded header
+	  */
+	~LuksDevice();
+	LuksDevice(const LuksDevice &) = delete;
+	LuksDevice &operator=(const LuksDevice &) = delete;
+	/**
+	  Start loading the luks header in the background, so that an unlock attempt only has to run the KDF
+	  */
+	void prefetch();
+	/**
+	  Start an unlock attempt with the current passphrase in the background. Does nothing while an attempt is
+	  running.
 	  @return 0 on success, non-zero on failure
 	  */
 	int unlock();
+	/**
+	  Re-encrypt the keyslot the passphrase opens with KDF parameters benchmarked on this machine, so that opening
+	  it takes about the given time. Runs on the calling thread.
+	  @param targetMs Time opening the keyslot should take, in ms
+	  @return Keyslot number on success, negative errno on failure
+	  */
+	int tuneKdf(Uint32 targetMs);
+	/**
+	  Ask the running unlock attempt to stop. A KDF run in progress can't be interrupted, so the attempt ends once
+	  it is done, and reports -ECANCELED unless it unlocked the device.
+	  */
+	void cancel();
+	/**
+	  Query the state of the device
+	  @return Whether the device is locked, being unlocked or unlocked
+	  */
+	UnlockState getState() const { return static_cast<UnlockState>(SDL_AtomicGet(&state)); };
 	/**
 	  Query luks device lock status
 	  @return Bool indicating whether luks device is locked or not
 	  */
-	bool isLocked() const { return locked; };
+	bool isLocked() const { return getState() != UnlockState::unlocked; };
 	/**
 	  Query luks device unlocking status
 	  @return Bool indicating that unlock thread is running or not
 	  */
-	bool unlockRunning() const { return running; };
+	bool unlockRunning() const { return getState() == UnlockState::unlocking; };
+	/**
+	  Get the number of finished unlock attempts, successful or not. Comparing this with an earlier value tells
+	  whether an attempt finished in between, even one that was too quick to ever be seen running.
+	  @return Number of finished unlock attempts
+	  */
+	int getFinishedAttempts() const { return SDL_AtomicGet(&finishedAttempts); };
 	/**
-	  Configure passphrase for luks device
+	  Query whether the luks header could be loaded. After a failed unlock attempt this tells a wrong passphrase
+	  (loaded) apart from problems with the device itself.
+	  @return Status of the luks header
+	  */
+	HeaderStatus getHeaderStatus() const { return static_cast<HeaderStatus>(SDL_AtomicGet(&headerStatus)); };
+	/**
+	  Get how far the running unlock attempt is, based on the expected duration of the KDF run
+	  @param elapsed Will be set to the time since the current KDF run started, in ms
+	  @param estimate Will be set to the expected duration of the current KDF run, in ms
+	  @return true if an attempt is running and its duration is known, false otherwise
+	  */
+	bool getUnlockProgress(Uint32 &elapsed, Uint32 &estimate) const;
+	/**
+	  Configure passphrase for luks device. The passphrase is not copied and has to outlive the device, an unlock
+	  attempt takes a locked copy when it starts and keeps using that.
 	  @param passphrase Passphrase to pass to luks device when activating it
 	  */
-	void setPassphrase(const std::string &value) { passphrase = value; };
+	void setPassphrase(const Passphrase &value) { passphrase = &value; };
+	/**
+	  Configure the file remembering the last keyslot that unlocked the device
+	  @param path Path of the file, empty to disable
+	  @param lock Mutex held while the file is rewritten, shared by all devices using the same file. Not owned,
+	  it has to outlive the device.
+	  */
+	void setKeyslotCache(const std::string &path, SDL_mutex *lock = nullptr)
+	{
+		keyslotCache = path;
+		keyslotCacheLock = lock;
+	};
+	/**
+	  Configure whether several keyslots are tried at the same time
+	  @param enabled Whether to try keyslots in parallel
+	  */
+	void setParallelKeyslots(bool enabled) { parallelKeyslots = enabled; };
+	/**
+	  Configure whether unlock attempts only check the passphrase, without creating the decrypted device. This
+	  needs no privileges.
+	  @param enabled Whether to only check the passphrase
+	  */
+	void setVerifyOnly(bool enabled) { verifyOnly = enabled; };
+	/**
+	  Get how long the phases of the last unlock attempt took. Phases that were done before, like loading a
+	  header that was prefetched, keep their earlier duration. Only valid while no attempt is running.
+	  @return Durations of the phases
+	  */
+	const UnlockTimings &getTimings() const { return timings; };
+	/**
+	  Configure how the device is activated
+	  @param flags CRYPT_ACTIVATE_* flags, see getActivationFlags()
+	  @param persistent Whether to store the flags in the LUKS2 header after a successful unlock
+	  */
+	void setActivationFlags(uint32_t flags, bool persistent)
+	{
+		activationFlags = flags;
+		persistentFlags = persistent;
+	};
+	/**
+	  Get the activation flags selected in the config. Flags this libcryptsetup doesn't know are left out.
+	  @param config Config parameters
+	  @return CRYPT_ACTIVATE_* flags
+	  */
+	static uint32_t getActivationFlags(const Config &config);
 
 private:
 	std::string deviceName;
 	std::string devicePath;
-	std::string passphrase;
-	bool locked = true;
-	bool running = false;
+	const Passphrase *passphrase = nullptr;
+	std::string keyslotCache;
+	SDL_mutex *keyslotCacheLock = nullptr;
+	bool parallelKeyslots = false;
+	bool verifyOnly = false;
+	UnlockTimings timings;
+	uint32_t activationFlags = CRYPT_ACTIVATE_ALLOW_DISCARDS;
+	bool persistentFlags = false;
+	// Copy of passphrase taken when the running attempt started
+	Passphrase attemptPassphrase;
+	SDL_Thread *unlockThread = nullptr;
+	mutable SDL_atomic_t state = {};
+	SDL_atomic_t cancelRequested = {};
 	Uint32 eventType;
+	// Loaded header, owned by the prefetch thread until it is joined, then by the unlock thread while it runs
+	struct crypt_device *cd = nullptr;
+	SDL_Thread *prefetchThread = nullptr;
+	SDL_mutex *mutex = nullptr;
+	mutable SDL_atomic_t headerStatus = {};
+	mutable SDL_atomic_t finishedAttempts = {};
+	// Start in SDL ticks and expected duration in ms of the running KDF, 0 if unknown
+	mutable SDL_atomic_t kdfStart = {};
+	mutable SDL_atomic_t kdfEstimate = {};
+	// Duration of a KDF run per unit of cost, measured by calibrate() for one KDF type
+	std::string calibratedKdf;
+	double msPerCost = 0;
 
+	/**
+	  Initialize the crypt device and load its header into cd, if that did not happen yet
+	  @return 0 on success, non-zero on failure
+	  */
+	int loadHeader();
+	/**
+	  Get the active keyslots in the order they should be tried: the hinted one first, then the others by
+	  increasing KDF cost
+	  @param hint Keyslot to try first, -1 for none
+	  @return Keyslot numbers, empty if the header lists none
+	  */
+	std::vector<int> getKeyslotOrder(int hint) const;
+	/**
+	  Read the last successful keyslot for this device from the keyslot cache
+	  @param duration Will be set to the time the keyslot took to unlock in ms, 0 if unknown
+	  @return Keyslot number, or -1 if none is known
+	  */
+	int readKeyslotHint(Uint32 &duration) const;
+	/**
+	  Remember the last successful keyslot for this device in the keyslot cache
+	  @param keyslot Keyslot number
+	  @param duration Time the keyslot took to unlock in ms
+	  */
+	void writeKeyslotHint(int keyslot, Uint32 duration) const;
+	/**
+	  Measure how fast the KDF of the keyslot that will be tried first runs on this device, unless the keyslot
+	  cache knows how long it took last time. Argon2 is measured with less memory than big keyslots use.
+	  */
+	void calibrate();
+	/**
+	  Estimate how long the KDF of a keyslot takes
+	  @param keyslot Keyslot number
+	  @param hint Keyslot from the keyslot cache, -1 for none
+	  @param hintDuration Duration of the hinted keyslot from the keyslot cache, 0 if unknown
+	  @return Duration in ms, 0 if unknown
+	  */
+	Uint32 estimateKdfDuration(int keyslot, int hint, Uint32 hintDuration) const;
+	/**
+	  Publish the expected duration of the KDF run that starts now
+	  @param estimate Duration in ms, 0 if unknown
+	  */
+	void setKdfEstimate(Uint32 estimate);
+	/**
+	  Get the number of keyslots that can be tried at the same time, bound by the number of CPUs and the memory
+	  the KDFs need
+	  @param keyslots Keyslots to try
+	  @return Number of threads to use, 1 if trying keyslots in parallel is not worth it
+	  */
+	int getParallelTrialCount(const std::vector<int> &keyslots) const;
+	/**
+	  Find the keyslot the passphrase belongs to using several threads, and activate the device with the volume key
+	  it unlocks. Returns once all threads are done, which takes at most one more KDF run after a success or cancel.
+	  @param keyslots Keyslots to try, in order
+	  @param threadCount Number of threads to use
+	  @param flags Activation flags
+	  @return Keyslot number on success, negative errno on failure
+	  */
+	int activateInParallel(const std::vector<int> &keyslots, int threadCount, uint32_t flags);
+	/**
+	  Try to activate the device with each keyslot in turn, in the order from getKeyslotOrder()
+	  @param flags Activation flags
+	  @return Keyslot number on success, negative errno on failure
+	  */
+	int activateByKeyslot(uint32_t flags);
+	/**
+	  Store activation flags in the LUKS2 header, so that later activations without osk-sdl use them too
+	  @param flags CRYPT_ACTIVATE_* flags
+	  */
+	void storeActivationFlags(uint32_t flags);
+	/**
+	  Get the name to activate the device as
+	  @return Name of the decrypted device, nullptr to only check the passphrase
+	  */
+	const char *getActivationName() const { return verifyOnly ? nullptr : deviceName.c_str(); };
+	/**
+	  Query whether cancel() was called since the running attempt started
+	  @return true if the attempt should stop, false otherwise
+	  */
+	bool isCancelled() { return SDL_AtomicGet(&cancelRequested) != 0; };
+	/**
+	  Wait for the thread of the last unlock attempt, if one was started
+	  */
+	void waitForUnlock();
+	/**
+	  Wait for the prefetch thread, if it was started
+	  */
+	void waitForPrefetch();
+	/**
+	  Load the luks header
+	  @param luksDev LuksDevice object to use, should represent 'this'
+	  */
+	static int prefetch(void *luksDev);
 	/**
 	  Unlock luks device
 	  @param luksDev LuksDevice object to use, should represent 'this'
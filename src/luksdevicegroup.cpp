@@ -0,0 +1,192 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "luksdevicegroup.h"
+#include "cpufreq.h"
+
+LuksDeviceGroup::LuksDeviceGroup(const std::vector<std::pair<std::string, std::string>> &deviceList,
+	Uint32 eventType)
+	: names(deviceList)
+{
+	for (auto &device : names) {
+		devices.push_back(std::make_unique<LuksDevice>(device.second, device.first, eventType));
+	}
+	keyslotCacheLock = SDL_CreateMutex();
+	if (!keyslotCacheLock) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to create keyslot cache mutex: %s", SDL_GetError());
+	}
+}
+
+LuksDeviceGroup::~LuksDeviceGroup()
+{
+	// Every device waits for its own attempt when it is freed, let them all stop at the same time
+	cancel();
+	// The unlock threads may still write the keyslot cache until their devices are gone
+	devices.clear();
+	if (keyslotCacheLock) {
+		SDL_DestroyMutex(keyslotCacheLock);
+	}
+}
+
+void LuksDeviceGroup::prefetch()
+{
+	for (const auto &device : devices) {
+		device->prefetch();
+	}
+}
+
+int LuksDeviceGroup::unlock()
+{
+	int ret = 0;
+	int finishedAttempts = getFinishedAttempts();
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (!devices[i]->isLocked() || devices[i]->unlockRunning()) {
+			continue;
+		}
+		SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Unlocking %s as %s", names[i].first.c_str(), names[i].second.c_str());
+		// Does nothing for the devices after the first one
+		if (cpufreqBoost) {
+			cpufreqBoost->boost();
+		}
+		if (devices[i]->unlock() != 0) {
+			ret = 1;
+		}
+	}
+	if (cpufreqBoost && !unlockRunning() && getFinishedAttempts() == finishedAttempts) {
+		// No thread was started, so no attempt will end and restore it
+		cpufreqBoost->restore();
+	}
+	return ret;
+}
+
+void LuksDeviceGroup::cancel()
+{
+	for (const auto &device : devices) {
+		device->cancel();
+	}
+}
+
+bool LuksDeviceGroup::isLocked() const
+{
+	for (const auto &device : devices) {
+		if (device->isLocked()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool LuksDeviceGroup::unlockRunning() const
+{
+	for (const auto &device : devices) {
+		if (device->unlockRunning()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int LuksDeviceGroup::getFinishedAttempts() const
+{
+	int attempts = 0;
+	for (const auto &device : devices) {
+		attempts += device->getFinishedAttempts();
+	}
+	return attempts;
+}
+
+HeaderStatus LuksDeviceGroup::getHeaderStatus() const
+{
+	HeaderStatus status = HeaderStatus::loaded;
+	for (const auto &device : devices) {
+		if (!device->isLocked()) {
+			continue;
+		}
+		HeaderStatus deviceStatus = device->getHeaderStatus();
+		if (deviceStatus == HeaderStatus::missingDevice || deviceStatus == HeaderStatus::badHeader) {
+			return deviceStatus;
+		}
+		if (deviceStatus == HeaderStatus::pending) {
+			status = deviceStatus;
+		}
+	}
+	return status;
+}
+
+float LuksDeviceGroup::getProgress() const
+{
+	if (devices.empty()) {
+		return 1.0f;
+	}
+	size_t done = 0;
+	for (const auto &device : devices) {
+		if (!device->unlockRunning()) {
+			done++;
+		}
+	}
+	return static_cast<float>(done) / static_cast<float>(devices.size());
+}
+
+bool LuksDeviceGroup::getUnlockProgress(Uint32 &elapsed, Uint32 &estimate) const
+{
+	bool known = false;
+	Sint64 longestRemaining = 0;
+	for (const auto &device : devices) {
+		Uint32 deviceElapsed, deviceEstimate;
+		if (!device->getUnlockProgress(deviceElapsed, deviceEstimate)) {
+			continue;
+		}
+		Sint64 remaining = static_cast<Sint64>(deviceEstimate) - deviceElapsed;
+		if (!known || remaining > longestRemaining) {
+			known = true;
+			longestRemaining = remaining;
+			elapsed = deviceElapsed;
+			estimate = deviceEstimate;
+		}
+	}
+	return known;
+}
+
+void LuksDeviceGroup::setPassphrase(const Passphrase &value)
+{
+	for (const auto &device : devices) {
+		device->setPassphrase(value);
+	}
+}
+
+void LuksDeviceGroup::setKeyslotCache(const std::string &path)
+{
+	for (const auto &device : devices) {
+		device->setKeyslotCache(path, keyslotCacheLock);
+	}
+}
+
+void LuksDeviceGroup::setParallelKeyslots(bool enabled)
+{
+	for (const auto &device : devices) {
+		device->setParallelKeyslots(enabled);
+	}
+}
+
+void LuksDeviceGroup::setActivationFlags(uint32_t flags, bool persistent)
+{
+	for (const auto &device : devices) {
+		device->setActivationFlags(flags, persistent);
+	}
+}
@@ -0,0 +1,136 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LUKSDEVICEGROUP_H
+#define LUKSDEVICEGROUP_H
+#include "luksdevice.h"
+#include <SDL2/SDL.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class CpufreqBoost;
+
+/*
+ * Set of luks devices that are unlocked with the same passphrase. Every device runs its unlock attempt on its own
+ * thread, so they all unlock at the same time, and devices that were unlocked already are not tried again.
+ */
+class LuksDeviceGroup {
+public:
+	/**
+	  Constructor
+	  @param deviceList Path and name of every luks device
+	  @param eventType SDL_EventType to push after an unlock attempt of any device, see LuksDevice::LuksDevice()
+	  */
+	LuksDeviceGroup(const std::vector<std::pair<std::string, std::string>> &deviceList, Uint32 eventType);
+	/**
+	  Cancel running unlock attempts and free all devices
+	  */
+	~LuksDeviceGroup();
+	LuksDeviceGroup(const LuksDeviceGroup &) = delete;
+	LuksDeviceGroup &operator=(const LuksDeviceGroup &) = delete;
+	/**
+	  Start loading the luks headers of all devices in the background
+	  */
+	void prefetch();
+	/**
+	  Start unlocking every device that is still locked, boosting the CPUs first if configured so
+	  @return 0 on success, non-zero if any unlock thread could not be started
+	  */
+	int unlock();
+	/**
+	  Ask the running unlock attempts to stop, see LuksDevice::cancel()
+	  */
+	void cancel();
+	/**
+	  Query whether any device is still locked
+	  @return true if at least one device is locked, false otherwise
+	  */
+	bool isLocked() const;
+	/**
+	  Query whether any unlock thread is running
+	  @return true if at least one device is being unlocked, false otherwise
+	  */
+	bool unlockRunning() const;
+	/**
+	  Get the number of finished unlock attempts over all devices, see LuksDevice::getFinishedAttempts()
+	  @return Number of finished unlock attempts
+	  */
+	int getFinishedAttempts() const;
+	/**
+	  Get the header status of the first locked device with a problem, so that problems with a device are reported
+	  before a wrong passphrase
+	  @return Status of the luks header
+	  */
+	HeaderStatus getHeaderStatus() const;
+	/**
+	  Get the share of devices that are not being unlocked anymore, either because they are unlocked or because
+	  their attempt failed
+	  @return Value between 0 and 1
+	  */
+	float getProgress() const;
+	/**
+	  Get how far the unlock attempts are, from the running device that is expected to take longest
+	  @param elapsed Will be set to the time since its KDF run started, in ms
+	  @param estimate Will be set to the expected duration of its KDF run, in ms
+	  @return true if the duration of any running attempt is known, false otherwise
+	  */
+	bool getUnlockProgress(Uint32 &elapsed, Uint32 &estimate) const;
+	/**
+	  Get the number of devices
+	  @return Number of devices
+	  */
+	size_t size() const { return devices.size(); };
+	/**
+	  Configure passphrase for all devices. The passphrase is not copied and has to outlive the group.
+	  @param passphrase Passphrase to pass to the luks devices when activating them
+	  */
+	void setPassphrase(const Passphrase &value);
+	/**
+	  Configure the file remembering the last keyslot that unlocked each device
+	  @param path Path of the file, empty to disable
+	  */
+	void setKeyslotCache(const std::string &path);
+	/**
+	  Configure whether several keyslots of a device are tried at the same time
+	  @param enabled Whether to try keyslots in parallel
+	  */
+	void setParallelKeyslots(bool enabled);
+	/**
+	  Configure how all devices are activated
+	  @param flags CRYPT_ACTIVATE_* flags
+	  @param persistent Whether to store the flags in the LUKS2 header after a successful unlock
+	  */
+	void setActivationFlags(uint32_t flags, bool persistent);
+	/**
+	  Configure the boost to apply right before unlock threads are started. The boost is not owned and has to
+	  outlive the group, it is restored once the attempt is over by whoever configured it.
+	  @param boost Boost to apply, nullptr to disable
+	  */
+	void setCpufreqBoost(CpufreqBoost *boost) { cpufreqBoost = boost; };
+
+private:
+	std::vector<std::pair<std::string, std::string>> names;
+	std::vector<std::unique_ptr<LuksDevice>> devices;
+	// Held by the unlock threads while they rewrite the shared keyslot cache
+	SDL_mutex *keyslotCacheLock = nullptr;
+	CpufreqBoost *cpufreqBoost = nullptr;
+};
+#endif
@@ -19,30 +19,67 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include "config.h"
+#include "cpufreq.h"
 #include "draw_helpers.h"
+#include "evdevinput.h"
+#include "fontmanager.h"
 #include "keyboard.h"
-#include "luksdevice.h"
+#include "keyring.h"
+#include "latency.h"
+#include "luksdevicegroup.h"
+#include "passphrase.h"
+#include "progressbar.h"
 #include "tooltip.h"
 #include "toggle.h"
+#include "trace.h"
 #include "util.h"
 #include <SDL2/SDL.h>
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <list>
 #include <string>
 #include <sys/reboot.h>
 #include <unistd.h>
 
-bool lastUnlockingState = false;
 bool showPasswordError = false;
+// Time from a tap or key press until the first frame showing its effect is presented
+LatencyHistogram inputLatency;
+// Global so that its destructor restores the governors on any exit() path too
+CpufreqBoost cpufreqBoost;
 constexpr char ErrorText[] = "Incorrect passphrase";
+constexpr char MissingDeviceText[] = "Encrypted disk not found";
+constexpr char BadHeaderText[] = "Disk is not a LUKS device";
+constexpr char TooLongText[] = "Passphrase is too long";
 constexpr char EnterPassText[] = "Enter disk decryption passphrase";
 constexpr char UnlockingDiskText[] = "Trying to unlock disk...";
 
+// Frame interval of the animation while unlocking with kdf-priority
+constexpr Uint32 KDF_PRIORITY_FRAME_MS = 100;
+// Set while a timer for the next throttled frame is pending, so that extra render events don't start more of them
+static SDL_atomic_t frameTimerPending;
+
+// Timer callback pushing an event of the type eventType points to. The event is built here, since the main thread
+// keeps writing to its own events while the timer runs.
+static Uint32 pushEvent(Uint32, void *eventType)
+{
+	SDL_Event event = {};
+	event.type = *static_cast<const Uint32 *>(eventType);
+	SDL_PushEvent(&event);
+	return 0;
+}
+
+static Uint32 pushFrameEvent(Uint32 interval, void *eventType)
+{
+	SDL_AtomicSet(&frameTimerPending, 0);
+	return pushEvent(interval, eventType);
+}
+
 int main(int argc, char **args)
 {
-	std::vector<std::string> passphrase;
+	Passphrase passphrase;
 	Opts opts {};
 	Config config;
 	SDL_Event event;
@@ -60,6 +97,11 @@ int main(int argc, char **args)
 	static SDL_Event renderEvent {
 		.type = renderEventType
 	};
+	static Uint32 unlockEventType = SDL_RegisterEvents(1);
+	static Uint32 latencyDumpEventType = SDL_RegisterEvents(1);
+	static Uint32 evdevEventType = SDL_RegisterEvents(1);
+	// Timestamp of the last input that a presented frame was measured for
+	Uint32 lastMeasuredInput = 0;
 
 	SDL_LogSetAllPriority(SDL_LOG_PRIORITY_ERROR);
 	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
@@ -68,6 +110,18 @@ int main(int argc, char **args)
 		exit(EXIT_FAILURE);
 	}
 
+	if (!opts.tracePath.empty() && Trace::start(opts.tracePath) == 0) {
+		// Written on any exit path, including the error paths below
+		atexit(Trace::stop);
+		Trace::setThreadName("ui");
+	}
+
+	LatencyHistogram::watchSignal(latencyDumpEventType);
+	atexit([] {
+		if (inputLatency.getCount() > 0) {
+			inputLatency.dump("Input latency");
+		}
+	});
 
 	if (opts.verbose) {
 		SDL_LogSetAllPriority(SDL_LOG_PRIORITY_INFO);
@@ -84,7 +138,50 @@ int main(int argc, char **args)
 		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Config override file could not be loaded, continuing");
 	}
 
-	LuksDevice luksDev(opts.luksDevName, opts.luksDevPath, renderEventType);
+	// Devices given on the command line take precedence over the ones in the config file
+	std::vector<std::pair<std::string, std::string>> luksDevices = config.luksDevices;
+	if (!opts.luksDevPaths.empty()) {
+		luksDevices.clear();
+		for (size_t i = 0; i < opts.luksDevPaths.size(); i++) {
+			luksDevices.emplace_back(opts.luksDevPaths[i], opts.luksDevNames[i]);
+		}
+	}
+	if (luksDevices.empty()) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "No device path specified, use -d [path] or -t");
+		exit(EXIT_FAILURE);
+	}
+
+	if (opts.tuneKdfMs > 0) {
+		// Headless, the passphrase comes from stdin
+		int c;
+		while ((c = getchar()) != EOF && c != '\n') {
+			char byte = static_cast<char>(c);
+			if (!passphrase.append(&byte, 1)) {
+				SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Passphrase is longer than %zu bytes", PASSPHRASE_CAPACITY);
+				passphrase.clear();
+				exit(EXIT_FAILURE);
+			}
+		}
+		LuksDevice tuneDev(luksDevices.front().second, luksDevices.front().first, 0);
+		tuneDev.setPassphrase(passphrase);
+		int ret = tuneDev.tuneKdf(opts.tuneKdfMs);
+		// exit() skips destructors
+		passphrase.clear();
+		exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	LuksDeviceGroup luksDev(luksDevices, unlockEventType);
+	luksDev.setKeyslotCache(config.keyslotCache);
+	luksDev.setParallelKeyslots(config.keyslotParallel);
+	luksDev.setActivationFlags(LuksDevice::getActivationFlags(config), config.cryptPersistentFlags);
+	cpufreqBoost.setSysfsRoot(config.cpufreqSysfsRoot);
+	if (config.cpufreqBoost) {
+		luksDev.setCpufreqBoost(&cpufreqBoost);
+	}
+	if (!opts.keyscript) {
+		// Read the header from slow storage while the user types
+		luksDev.prefetch();
+	}
 
 	atexit(SDL_Quit);
 
@@ -108,7 +205,7 @@ int main(int argc, char **args)
 		sdlFlags |= SDL_INIT_HAPTIC;
 	}
 
-	if (SDL_Init(sdlFlags) < 0) {
+	if (traceCall("SDL_Init", [&] { return SDL_Init(sdlFlags); }) < 0) {
 		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "SDL_Init failed: %s", SDL_GetError());
 		exit(EXIT_FAILURE);
 	}
@@ -117,7 +214,7 @@ int main(int argc, char **args)
 		// Switch to the resolution of the framebuffer if not running
 		// in test mode.
 		SDL_DisplayMode mode = { SDL_PIXELFORMAT_UNKNOWN, 0, 0, 0, nullptr };
-		if (SDL_GetDisplayMode(0, 0, &mode) != 0) {
+		if (traceCall("SDL_GetDisplayMode", [&] { return SDL_GetDisplayMode(0, 0, &mode); }) != 0) {
 			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "SDL_GetDisplayMode failed: %s", SDL_GetError());
 			exit(EXIT_FAILURE);
 		}
@@ -152,14 +249,14 @@ int main(int argc, char **args)
 	int rendererIndex = -1;
 	if (!opts.noGLES && !isDirectFB())
 		rendererIndex = find_gles_driver_index();
-	renderer = SDL_CreateRenderer(display, rendererIndex, 0);
+	renderer = traceCall("SDL_CreateRenderer", [&] { return SDL_CreateRenderer(display, rendererIndex, 0); });
 
 	if (renderer == nullptr) {
 		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Could not create renderer: %s", SDL_GetError());
 		exit(EXIT_FAILURE);
 	}
 
-	if (TTF_Init() == -1) {
+	if (traceCall("TTF_Init", [] { return TTF_Init(); }) == -1) {
 		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "TTF_Init: %s", TTF_GetError());
 		exit(EXIT_FAILURE);
 	}
@@ -238,6 +335,28 @@ int main(int argc, char **args)
 		exit(EXIT_FAILURE);
 	}
 
+	Tooltip missingDeviceTooltip(TooltipType::error, inputWidth, inputHeight, inputBoxRadius, &config);
+	if (missingDeviceTooltip.init(renderer, MissingDeviceText)) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Failed to initialize missingDeviceTooltip!");
+		exit(EXIT_FAILURE);
+	}
+
+	Tooltip badHeaderTooltip(TooltipType::error, inputWidth, inputHeight, inputBoxRadius, &config);
+	if (badHeaderTooltip.init(renderer, BadHeaderText)) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Failed to initialize badHeaderTooltip!");
+		exit(EXIT_FAILURE);
+	}
+
+	Tooltip tooLongTooltip(TooltipType::error, inputWidth, inputHeight, inputBoxRadius, &config);
+	if (tooLongTooltip.init(renderer, TooLongText)) {
+		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Failed to initialize tooLongTooltip!");
+		exit(EXIT_FAILURE);
+	}
+	// Error shown while showPasswordError is set
+	Tooltip *errorTooltip = &passErrorTooltip;
+	// Set when a key was refused because it doesn't fit into the passphrase anymore
+	bool passphraseTooLong = false;
+
 	Tooltip enterPassTooltip(TooltipType::info, inputWidth, inputHeight, inputBoxRadius, &config);
 	if (enterPassTooltip.init(renderer, EnterPassText)) {
 		SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Failed to initialize enterPassTooltip!");
@@ -259,6 +378,10 @@ int main(int argc, char **args)
 	}
 	keyboardToggle.setVisible(!show_osk);
 
+	ProgressBar progressBar(inputWidth, std::max(inputHeight / 8, 2), &config);
+	// Without animations nothing else redraws while unlocking, so the progress bar asks for it once per second
+	Uint32 nextProgressRedraw = 0;
+
 	argb inputBoxColor = config.inputBoxBackground;
 
 	SDL_Surface *inputBox = make_input_box(inputWidth, inputHeight, &inputBoxColor, inputBoxRadius);
@@ -289,12 +412,46 @@ int main(int argc, char **args)
 	// Start drawing keyboard when main loop starts
 	SDL_PushEvent(&renderEvent);
 
+	// Started once the keyboard is laid out, so that no touch arrives before it can be handled
+	EvdevInput evdevInput(evdevEventType);
+	bool evdevTouch = !config.evdevDevices.empty() && evdevInput.start(config.evdevDevices, WIDTH, HEIGHT) == 0;
+
+	// Unlock attempts whose result event arrived, and whose result was shown
+	int deliveredAttempts = 0;
+	int handledAttempts = 0;
+	// Set when an attempt was cancelled because the passphrase was edited, its failure is not an error
+	bool attemptCancelled = false;
+	// Time the running attempt was first rendered, 0 while there is none
+	Uint32 unlockStartTicks = 0;
+	auto endUnlockTiming = [&](const char *result) {
+		SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Unlock attempt %s after %u ms, kdf-priority %s, cpufreq-boost %s",
+			result, SDL_GetTicks() - unlockStartTicks, config.kdfPriority ? "on" : "off",
+			config.cpufreqBoost ? "on" : "off");
+		cpufreqBoost.restore();
+		if (config.kdfPriority && SDL_SetThreadPriority(SDL_THREAD_PRIORITY_NORMAL) != 0) {
+			SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to restore UI thread priority: %s", SDL_GetError());
+		}
+		unlockStartTicks = 0;
+	};
+
 	// The Main Loop.
 	bool done = false;
+	bool presented = false;
 	int cur_ticks = 0;
 	while (luksDev.isLocked() && !done) {
 		show_osk = !keyboardToggle.isVisible();
 		if (SDL_WaitEvent(&event)) {
+			// With evdev input, SDL reports the same touches again, as fingers or, through tslib, as mouse clicks
+			if (evdevTouch
+				&& (event.type == SDL_FINGERDOWN || event.type == SDL_FINGERUP || event.type == SDL_FINGERMOTION
+					|| event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP)) {
+				continue;
+			}
+			// Render events pushed while handling an input carry its timestamp, see the render event handler
+			renderEvent.user.code = 0;
+			if (event.type == SDL_KEYDOWN || event.type == SDL_FINGERDOWN || event.type == SDL_MOUSEBUTTONDOWN) {
+				renderEvent.user.code = static_cast<Sint32>(event.common.timestamp);
+			}
 			// an event was found
 			switch (event.type) {
 			// handle the keyboard
@@ -308,6 +465,7 @@ int main(int argc, char **args)
 				prev_keydown_ticks = cur_ticks;
 				if (SDL_GetModState() & KMOD_CTRL) {
 					if (event.key.keysym.sym == SDLK_u) {
+						luksDev.cancel();
 						passphrase.clear();
 						SDL_PushEvent(&renderEvent);
 						continue;
@@ -316,8 +474,7 @@ int main(int argc, char **args)
 				switch (event.key.keysym.sym) {
 				case SDLK_RETURN:
 					if (!passphrase.empty() && !luksDev.unlockRunning()) {
-						std::string pass = strVector2str(passphrase);
-						luksDev.setPassphrase(pass);
+						luksDev.setPassphrase(passphrase);
 						if (opts.keyscript) {
 							done = true;
 						} else {
@@ -326,8 +483,10 @@ int main(int argc, char **args)
 					}
 					break; // SDLK_RETURN
 				case SDLK_BACKSPACE:
-					if (!passphrase.empty() && !luksDev.unlockRunning()) {
-						passphrase.pop_back();
+					if (!passphrase.empty()) {
+						// Editing the passphrase makes a running attempt pointless
+						luksDev.cancel();
+						passphrase.pop();
 						SDL_PushEvent(&renderEvent);
 						continue;
 					}
@@ -354,25 +513,46 @@ int main(int argc, char **args)
 				// x and y values are normalized!
 				auto xTouch = static_cast<unsigned>(event.tfinger.x * WIDTH);
 				auto yTouch = static_cast<unsigned>(event.tfinger.y * HEIGHT);
-				handleTapBegin(xTouch, yTouch, HEIGHT, keyboard);
+				handleTapBegin(xTouch, yTouch, HEIGHT, keyboard, event.tfinger.fingerId);
 				SDL_PushEvent(&renderEvent);
 				break; // SDL_FINGERDOWN
 			}
+			case SDL_FINGERMOTION: {
+				auto xTouch = static_cast<unsigned>(event.tfinger.x * WIDTH);
+				auto yTouch = static_cast<unsigned>(event.tfinger.y * HEIGHT);
+				if (handleTapMove(xTouch, yTouch, HEIGHT, keyboard, event.tfinger.fingerId)) {
+					SDL_PushEvent(&renderEvent);
+				}
+				break; // SDL_FINGERMOTION
+			}
 			case SDL_FINGERUP: {
 				auto xTouch = static_cast<unsigned>(event.tfinger.x * WIDTH);
 				auto yTouch = static_cast<unsigned>(event.tfinger.y * HEIGHT);
-				handleTapEnd(xTouch, yTouch, HEIGHT, keyboard, keyboardToggle, luksDev, passphrase, opts.keyscript, showPasswordError, done);
+				handleTapEnd(xTouch, yTouch, HEIGHT, keyboard, keyboardToggle, luksDev, passphrase, opts.keyscript, showPasswordError, passphraseTooLong, done, event.tfinger.fingerId);
+				if (passphraseTooLong) {
+					errorTooltip = &tooLongTooltip;
+				}
 				SDL_PushEvent(&renderEvent);
 				break; // SDL_FINGERUP
 			}
 				// handle the mouse
 			case SDL_MOUSEBUTTONDOWN: {
-				handleTapBegin(event.button.x, event.button.y, HEIGHT, keyboard);
+				// Touches are handled as fingers already
+				if (event.button.which == SDL_TOUCH_MOUSEID) {
+					break;
+				}
+				handleTapBegin(event.button.x, event.button.y, HEIGHT, keyboard, MOUSE_POINTER_ID);
 				SDL_PushEvent(&renderEvent);
 				break; // SDL_MOUSEBUTTONDOWN
 			}
 			case SDL_MOUSEBUTTONUP: {
-				handleTapEnd(event.button.x, event.button.y, HEIGHT, keyboard, keyboardToggle, luksDev, passphrase, opts.keyscript, showPasswordError, done);
+				if (event.button.which == SDL_TOUCH_MOUSEID) {
+					break;
+				}
+				handleTapEnd(event.button.x, event.button.y, HEIGHT, keyboard, keyboardToggle, luksDev, passphrase, opts.keyscript, showPasswordError, passphraseTooLong, done, MOUSE_POINTER_ID);
+				if (passphraseTooLong) {
+					errorTooltip = &tooLongTooltip;
+				}
 				SDL_PushEvent(&renderEvent);
 				break; // SDL_MOUSEBUTTONUP
 			}
@@ -394,19 +574,67 @@ int main(int argc, char **args)
 				// Enable key repeat delay
 				if ((cur_ticks - repeat_delay.count()) > prev_text_ticks) {
 					prev_text_ticks = cur_ticks;
-					if (!luksDev.unlockRunning()) {
-						passphrase.emplace_back(event.text.text);
-						SDL_PushEvent(&renderEvent);
+					if (passphrase.append(event.text.text, strlen(event.text.text))) {
+						luksDev.cancel();
 						SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Phys Keyboard Key Entered %s", event.text.text);
+					} else {
+						// Trying a truncated passphrase would only report it as wrong
+						showPasswordError = true;
+						errorTooltip = &tooLongTooltip;
 					}
+					SDL_PushEvent(&renderEvent);
 				}
 				break; // SDL_TEXTINPUT
 			}
 			case SDL_QUIT:
 				SDL_Log("Quit requested, quitting.");
-				exit(0);
+				// Leave through the cleanup path, so the devices cancel and join their unlock jobs on the way out.
+				// Nothing was entered for a later step to use.
+				passphrase.clear();
+				goto QUIT;
 				break; // SDL_QUIT
 			} // switch event.type
+			if (event.type == unlockEventType) {
+				deliveredAttempts++;
+				if (event.user.code == -ECANCELED) {
+					attemptCancelled = true;
+				}
+				SDL_PushEvent(&renderEvent);
+			}
+			if (event.type == latencyDumpEventType) {
+				inputLatency.dump("Input latency");
+			}
+			if (event.type == evdevEventType) {
+				TouchEvent touch;
+				while (evdevInput.poll(touch)) {
+					switch (touch.type) {
+					case TouchEventType::down:
+						handleTapBegin(touch.x, touch.y, HEIGHT, keyboard, touch.pointerId);
+						// Timed from when the kernel saw the touch
+						renderEvent.user.code = static_cast<Sint32>(touch.timestamp);
+						break;
+					case TouchEventType::motion:
+						handleTapMove(touch.x, touch.y, HEIGHT, keyboard, touch.pointerId);
+						break;
+					case TouchEventType::up:
+						handleTapEnd(touch.x, touch.y, HEIGHT, keyboard, keyboardToggle, luksDev, passphrase,
+							opts.keyscript, showPasswordError, passphraseTooLong, done, touch.pointerId);
+						if (passphraseTooLong) {
+							errorTooltip = &tooLongTooltip;
+						}
+						break;
+					case TouchEventType::cancel:
+						keyboard.releaseKey(touch.pointerId, nullptr);
+						break;
+					}
+				}
+				if (evdevTouch && !evdevInput.isReading()) {
+					// Otherwise nothing could be typed anymore without a physical keyboard
+					SDL_LogInfo(SDL_LOG_CATEGORY_INPUT, "Using SDL input again");
+					evdevTouch = false;
+				}
+				SDL_PushEvent(&renderEvent);
+			}
 			// Render event handler
 			if (event.type == renderEventType) {
 				/* NOTE ON MULTI BUFFERING / RENDERING MULTIPLE TIMES:
@@ -428,6 +656,16 @@ int main(int argc, char **args)
 				   updates show on screen for drivers that use
 				   triple buffering
 				 */
+				TRACE_SCOPE("render pass");
+				// A finished attempt is still shown as running until its result is handled below
+				bool unlocking = luksDev.unlockRunning() || luksDev.getFinishedAttempts() != handledAttempts;
+				if (unlocking && !unlockStartTicks) {
+					unlockStartTicks = SDL_GetTicks();
+					// Let the KDF threads win every fight for a CPU
+					if (config.kdfPriority && SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW) != 0) {
+						SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to lower UI thread priority: %s", SDL_GetError());
+					}
+				}
 				int render_times = 0;
 				int max_render_times = (rendererInfo.flags & SDL_RENDERER_ACCELERATED) ? 3 : 2;
 				while (render_times < max_render_times) {
@@ -435,7 +673,7 @@ int main(int argc, char **args)
 					SDL_RenderClear(renderer);
 
 					// Hide keyboard if unlock luks thread is running
-					keyboard.setTargetPosition(!luksDev.unlockRunning());
+					keyboard.setTargetPosition(!unlocking);
 
 					// When *not* using animations, so draw keyboard first so tooltip is positioned correctly from the start
 					if (!config.animations && show_osk) {
@@ -446,14 +684,26 @@ int main(int argc, char **args)
 					inputBoxRect.y = static_cast<int>(topHalf / 3.5);
 					// Only show either error tooltip, enter password tooltip, or password input box
 					if (showPasswordError) {
-						passErrorTooltip.draw(renderer, inputBoxRect.x, inputBoxRect.y);
-					} else if (passphrase.size() == 0) {
+						errorTooltip->draw(renderer, inputBoxRect.x, inputBoxRect.y);
+					} else if (passphrase.empty()) {
 						enterPassTooltip.draw(renderer, inputBoxRect.x, inputBoxRect.y);
-					} else if (luksDev.unlockRunning() && !config.animations) {
+					} else if (unlocking && !config.animations) {
 						unlockingTooltip.draw(renderer, inputBoxRect.x, inputBoxRect.y);
 					} else {
 						SDL_RenderCopy(renderer, inputBoxTexture, nullptr, &inputBoxRect);
-						draw_password_box_dots(renderer, &config, inputBoxRect, passphrase.size(), luksDev.unlockRunning());
+						draw_password_box_dots(renderer, &config, inputBoxRect, passphrase.length(), unlocking);
+					}
+					// Right below the input box, the expected progress of the KDF if its duration is known, otherwise
+					// the share of the devices that are done
+					Uint32 kdfElapsed, kdfEstimate;
+					int progressY = inputBoxRect.y + inputBoxRect.h + inputBoxRect.h / 4;
+					if (unlocking && luksDev.getUnlockProgress(kdfElapsed, kdfEstimate)) {
+						// Never shown as complete, the estimate may be short
+						float fraction = std::min(static_cast<float>(kdfElapsed) / kdfEstimate, 0.99f);
+						int secondsLeft = kdfElapsed < kdfEstimate ? (kdfEstimate - kdfElapsed + 999) / 1000 : 0;
+						progressBar.draw(renderer, inputBoxRect.x, progressY, fraction, secondsLeft);
+					} else if (unlocking && luksDev.size() > 1) {
+						progressBar.draw(renderer, inputBoxRect.x, progressY, luksDev.getProgress(), -1);
 					}
 					if (!show_osk)
 						keyboardToggle.draw(renderer, WIDTH-(WIDTH/10), HEIGHT-(HEIGHT/15));
@@ -462,54 +712,112 @@ int main(int argc, char **args)
 					if (config.animations && show_osk) {
 						keyboard.draw(renderer, HEIGHT);
 					}
-					SDL_RenderPresent(renderer);
-					if (keyboard.isInSlideAnimation()) {
+					if (!presented) {
+						traceCall("first SDL_RenderPresent", [&] { SDL_RenderPresent(renderer); });
+						presented = true;
+					} else {
+						SDL_RenderPresent(renderer);
+					}
+					// Only the first present after an input shows its effect, an input usually causes several
+					// render events and passes
+					auto inputTimestamp = static_cast<Uint32>(event.user.code);
+					if (inputTimestamp != 0 && inputTimestamp != lastMeasuredInput
+						&& SDL_TICKS_PASSED(inputTimestamp, lastMeasuredInput)) {
+						inputLatency.record(static_cast<uint64_t>(SDL_GetTicks() - inputTimestamp) * 1000);
+						lastMeasuredInput = inputTimestamp;
+					}
+					if (keyboard.isInSlideAnimation() || (config.kdfPriority && unlocking)) {
 						// No need to double-flip if we'll redraw more for animation
 						// in a tiny moment anyway.
 						break;
 					}
 				}
 
-				if (lastUnlockingState != luksDev.unlockRunning()) {
-					if (!luksDev.unlockRunning() && luksDev.isLocked()) {
-						// Luks is finished and the password was wrong
+				// Something is on screen now, rasterize the other keyboard layers in the background
+				keyboard.warmUp();
+
+				// A failed attempt is only shown once the keyboard finished sliding away, so that a quick failure
+				// doesn't make it jump, and once the results of all devices arrived. Success ends the main loop right away.
+				if (unlocking && !luksDev.unlockRunning() && deliveredAttempts == luksDev.getFinishedAttempts()
+					&& (!show_osk || !keyboard.isInSlideAnimation())) {
+					handledAttempts = luksDev.getFinishedAttempts();
+					endUnlockTiming(attemptCancelled ? "cancelled" : "failed");
+					if (luksDev.isLocked() && attemptCancelled) {
+						// The passphrase was edited meanwhile, keep it
+						attemptCancelled = false;
+					} else if (luksDev.isLocked()) {
 						showPasswordError = true;
-						passphrase.clear();
+						switch (luksDev.getHeaderStatus()) {
+						case HeaderStatus::missingDevice:
+							// Keep the passphrase, so it can be tried again once the device shows up
+							errorTooltip = &missingDeviceTooltip;
+							break;
+						case HeaderStatus::badHeader:
+							errorTooltip = &badHeaderTooltip;
+							break;
+						default:
+							// Luks is finished and the password was wrong
+							errorTooltip = &passErrorTooltip;
+							passphrase.clear();
+							break;
+						}
 						// Show default keyboard layer again on wrong passphrase
 						keyboard.setActiveLayer(0);
-						SDL_PushEvent(&renderEvent);
 					}
-					lastUnlockingState = luksDev.unlockRunning();
+					SDL_PushEvent(&renderEvent);
+				}
+				if (unlocking && !config.animations && SDL_TICKS_PASSED(SDL_GetTicks(), nextProgressRedraw)) {
+					nextProgressRedraw = SDL_GetTicks() + 900;
+					SDL_AddTimer(1000, pushEvent, &renderEventType);
 				}
 				// If any animations are enabled and running, continue to push render events to the
 				// event queue
-				if (config.animations && (luksDev.unlockRunning() || keyboard.isInSlideAnimation())) {
+				if (config.animations && unlocking && config.kdfPriority && !keyboard.isInSlideAnimation()) {
+					if (SDL_AtomicCAS(&frameTimerPending, 0, 1)) {
+						SDL_AddTimer(KDF_PRIORITY_FRAME_MS, pushFrameEvent, &renderEventType);
+					}
+				} else if (config.animations && (unlocking || keyboard.isInSlideAnimation())) {
 					SDL_PushEvent(&renderEvent);
 				}
 			}
 		} // event handle loop
 	} // main loop
 
+	if (unlockStartTicks && !luksDev.isLocked()) {
+		endUnlockTiming("succeeded");
+	}
+
 QUIT:
+	// An attempt that ended before any render pass saw it still boosted the CPUs when it started
+	cpufreqBoost.restore();
 	if (inputBoxTexture)
 		SDL_DestroyTexture(inputBoxTexture);
 
 	keyboardToggle.cleanup();
 	passErrorTooltip.cleanup();
+	missingDeviceTooltip.cleanup();
+	badHeaderTooltip.cleanup();
+	tooLongTooltip.cleanup();
 	enterPassTooltip.cleanup();
 	unlockingTooltip.cleanup();
+	progressBar.cleanup();
 	keyboard.cleanup();
 
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(display);
 
+	FontManager::closeAll();
 	TTF_Quit();
 
 	SDL_QuitSubSystem(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_TIMER | SDL_INIT_HAPTIC);
 
+	// Only a passphrase that was accepted is worth handing on, i.e. not when leaving with escape
+	if (!config.keyringDescription.empty() && (opts.keyscript ? done : !luksDev.isLocked())) {
+		addPassphraseToKeyring(config.keyringDescription, passphrase, std::max(config.keyringTimeout, 0));
+	}
+
 	if (opts.keyscript) {
-		std::string pass = strVector2str(passphrase);
-		printf("%s", pass.c_str());
+		fwrite(passphrase.data(), 1, passphrase.size(), stdout);
 		fflush(stdout);
 	}
 	return 0;
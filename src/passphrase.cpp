@@ -0,0 +1,111 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "passphrase.h"
+#include <SDL2/SDL.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+
+// Continuation bytes of a UTF-8 sequence look like 10xxxxxx
+static bool isContinuationByte(char c)
+{
+	return (static_cast<unsigned char>(c) & 0xc0) == 0x80;
+}
+
+Passphrase::Passphrase()
+{
+	// A mapping of its own, so that unlocking it can't unlock memory of anything else sharing the page
+	void *mapping = mmap(nullptr, PASSPHRASE_CAPACITY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to allocate passphrase buffer: %s", strerror(errno));
+		return;
+	}
+	buffer = static_cast<char *>(mapping);
+	capacity = PASSPHRASE_CAPACITY;
+	if (mlock(buffer, capacity) != 0) {
+		// Without CAP_IPC_LOCK this is bound by RLIMIT_MEMLOCK, the passphrase still works, it may just be swapped
+		static bool warned = false;
+		if (!warned) {
+			SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to lock passphrase buffer in memory: %s", strerror(errno));
+			warned = true;
+		}
+	}
+	madvise(buffer, capacity, MADV_DONTDUMP);
+}
+
+Passphrase::~Passphrase()
+{
+	if (!buffer) {
+		return;
+	}
+	clear();
+	munlock(buffer, capacity);
+	munmap(buffer, capacity);
+}
+
+bool Passphrase::append(const char *text, size_t length)
+{
+	if (length > capacity - used) {
+		return false;
+	}
+	for (size_t i = 0; i < length; i++) {
+		if (!isContinuationByte(text[i])) {
+			characters++;
+		}
+	}
+	memcpy(buffer + used, text, length);
+	used += length;
+	return true;
+}
+
+void Passphrase::pop()
+{
+	if (used == 0) {
+		return;
+	}
+	// A code point is at most 4 bytes, so this never looks at more than 3 continuation bytes
+	size_t start = used - 1;
+	while (start > 0 && used - start < 4 && isContinuationByte(buffer[start])) {
+		start--;
+	}
+	if (!isContinuationByte(buffer[start])) {
+		characters--;
+	}
+	explicit_bzero(buffer + start, used - start);
+	used = start;
+}
+
+void Passphrase::assign(const Passphrase &other)
+{
+	if (&other == this) {
+		return;
+	}
+	clear();
+	append(other.data(), other.size());
+}
+
+void Passphrase::clear()
+{
+	if (buffer) {
+		explicit_bzero(buffer, used);
+	}
+	used = 0;
+	characters = 0;
+}
@@ -0,0 +1,97 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PASSPHRASE_H
+#define PASSPHRASE_H
+#include <cstddef>
+#include <string>
+
+// Longest passphrase in bytes, cryptsetup itself reads at most 512 bytes from a terminal
+constexpr size_t PASSPHRASE_CAPACITY = 512;
+
+/*
+ * UTF-8 passphrase in a buffer of fixed size that is kept out of swap and core dumps, and wiped whenever its
+ * content is dropped. Editing it never allocates, so no stray copies are left behind on the heap.
+ */
+class Passphrase {
+public:
+	/**
+	  Constructor, maps and locks the buffer
+	  */
+	Passphrase();
+	/**
+	  Wipe and unmap the buffer
+	  */
+	~Passphrase();
+	Passphrase(const Passphrase &) = delete;
+	Passphrase &operator=(const Passphrase &) = delete;
+	/**
+	  Append UTF-8 text. Nothing is appended if the text doesn't fit.
+	  @param text Text to append
+	  @param length Length of text in bytes
+	  @return true on success, false if the passphrase would get too long
+	  */
+	bool append(const char *text, size_t length);
+	/**
+	  Append UTF-8 text. Nothing is appended if the text doesn't fit.
+	  @param text Text to append
+	  @return true on success, false if the passphrase would get too long
+	  */
+	bool append(const std::string &text) { return append(text.data(), text.size()); };
+	/**
+	  Remove the last character, i.e. the last UTF-8 code point. Does nothing if the passphrase is empty.
+	  */
+	void pop();
+	/**
+	  Replace the content with a copy of another passphrase
+	  @param other Passphrase to copy
+	  */
+	void assign(const Passphrase &other);
+	/**
+	  Wipe the content
+	  */
+	void clear();
+	/**
+	  Get the content, it is not null-terminated
+	  @return Pointer to the UTF-8 bytes
+	  */
+	const char *data() const { return buffer; };
+	/**
+	  Get the length in bytes
+	  @return Number of bytes
+	  */
+	size_t size() const { return used; };
+	/**
+	  Get the length in characters, i.e. UTF-8 code points
+	  @return Number of characters
+	  */
+	size_t length() const { return characters; };
+	/**
+	  Query whether the passphrase is empty
+	  @return true if it is empty, false otherwise
+	  */
+	bool empty() const { return used == 0; };
+
+private:
+	char *buffer = nullptr;
+	size_t capacity = 0;
+	size_t used = 0;
+	size_t characters = 0;
+};
+#endif
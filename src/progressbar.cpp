@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "progressbar.h"
+#include "fontmanager.h"
+#include <SDL2/SDL_ttf.h>
+#include <algorithm>
+#include <string>
+
+ProgressBar::ProgressBar(int width, int height, Config *config)
+	: config(config)
+	, width(width)
+	, height(height)
+{
+}
+
+void ProgressBar::cleanup()
+{
+	if (textTexture) {
+		SDL_DestroyTexture(textTexture);
+		textTexture = nullptr;
+	}
+	textSeconds = -1;
+}
+
+void ProgressBar::draw(SDL_Renderer *renderer, int x, int y, float fraction, int secondsLeft)
+{
+	Uint8 r, g, b, a;
+	SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+
+	SDL_Rect track = { x, y, width, height };
+	SDL_SetRenderDrawColor(renderer, config->inputBoxBackground.r, config->inputBoxBackground.g,
+		config->inputBoxBackground.b, 255);
+	SDL_RenderFillRect(renderer, &track);
+	SDL_Rect filled = { x, y, static_cast<int>(width * std::clamp(fraction, 0.0f, 1.0f)), height };
+	SDL_SetRenderDrawColor(renderer, config->inputBoxForeground.r, config->inputBoxForeground.g,
+		config->inputBoxForeground.b, 255);
+	SDL_RenderFillRect(renderer, &filled);
+	SDL_SetRenderDrawColor(renderer, r, g, b, a);
+
+	if (secondsLeft < 0) {
+		return;
+	}
+	if (secondsLeft != textSeconds) {
+		cleanup();
+		TTF_Font *font = FontManager::get(config->keyboardFont, config->keyboardFontSize);
+		if (!font) {
+			return;
+		}
+		std::string text = secondsLeft > 0 ? "About " + std::to_string(secondsLeft) + " s left" : "Almost done";
+		SDL_Color textColor = { config->inputBoxForeground.r, config->inputBoxForeground.g,
+			config->inputBoxForeground.b, config->inputBoxForeground.a };
+		SDL_Surface *textSurface = TTF_RenderUTF8_Blended(font, text.c_str(), textColor);
+		if (!textSurface) {
+			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Unable to render progress text: %s", TTF_GetError());
+			return;
+		}
+		textTexture = SDL_CreateTextureFromSurface(renderer, textSurface);
+		textWidth = textSurface->w;
+		textHeight = textSurface->h;
+		SDL_FreeSurface(textSurface);
+		textSeconds = secondsLeft;
+	}
+	SDL_Rect textRect = { x + (width - textWidth) / 2, y + height * 2, textWidth, textHeight };
+	SDL_RenderCopy(renderer, textTexture, nullptr, &textRect);
+}
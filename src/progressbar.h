@@ -0,0 +1,61 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRESSBAR_H
+#define PROGRESSBAR_H
+
+#include "config.h"
+#include <SDL2/SDL.h>
+
+class ProgressBar {
+public:
+	/**
+	  Constructor
+	  @param width Width of the bar
+	  @param height Height of the bar, the remaining time is drawn below it
+	  @param config Config object
+	  */
+	ProgressBar(int width, int height, Config *config);
+	/**
+	  Free memory allocated on creation/use of this object. The progress bar object should be considered dead after
+	  calling this, and not used.
+	*/
+	void cleanup();
+	/**
+	  Draw progress bar
+	  @param renderer Initialized SDL renderer object
+	  @param x X-axis coordinate
+	  @param y Y-axis coordinate
+	  @param fraction Share of the bar to fill, between 0 and 1
+	  @param secondsLeft Remaining time to show below the bar, negative to show none
+	  */
+	void draw(SDL_Renderer *renderer, int x, int y, float fraction, int secondsLeft);
+
+private:
+	SDL_Texture *textTexture = nullptr;
+	Config *config;
+	int width;
+	int height;
+	// Value textTexture shows, it is only rendered again when this changes
+	int textSeconds = -1;
+	int textWidth = 0;
+	int textHeight = 0;
+};
+
+#endif
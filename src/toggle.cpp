@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "toggle.h"
 #include "draw_helpers.h"
+#include "fontmanager.h"
 
 
 Toggle::Toggle(int width, int height, Config *config)
@@ -66,7 +67,11 @@ int Toggle::init(SDL_Renderer *renderer, const std::string &text)
 	Uint32 background = SDL_MapRGB(surface->format, backgroundColor.r, backgroundColor.g, backgroundColor.b);
 	SDL_FillRect(surface, nullptr, background);
 
-	TTF_Font *font = TTF_OpenFont(config->keyboardFont.c_str(), config->keyboardFontSize);
+	TTF_Font *font = FontManager::get(config->keyboardFont, config->keyboardFontSize);
+	if (!font) {
+		SDL_FreeSurface(surface);
+		return -1;
+	}
 	SDL_Surface *textSurface;
 	SDL_Color textColor = { foregroundColor.r, foregroundColor.g, foregroundColor.b, foregroundColor.a };
 	textSurface = TTF_RenderText_Blended(font, text.c_str(), textColor);
@@ -80,7 +85,6 @@ int Toggle::init(SDL_Renderer *renderer, const std::string &text)
 
 	texture = SDL_CreateTextureFromSurface(renderer, surface);
 
-	TTF_CloseFont(font);
 	SDL_FreeSurface(textSurface);
 	SDL_FreeSurface(surface);
 
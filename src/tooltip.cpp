@@ -19,6 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "tooltip.h"
 #include "draw_helpers.h"
+#include "fontmanager.h"
+#include "trace.h"
 
 Tooltip::Tooltip(TooltipType type, int width, int height, int cornerRadius, Config *config)
 	: config(config)
@@ -39,6 +41,7 @@ void Tooltip::cleanup()
 
 int Tooltip::init(SDL_Renderer *renderer, const std::string &text)
 {
+	TRACE_SCOPE("Tooltip::init");
 	SDL_Surface *surface;
 	Uint32 rmask, gmask, bmask;
 	argb foregroundColor, backgroundColor;
@@ -79,7 +82,11 @@ int Tooltip::init(SDL_Renderer *renderer, const std::string &text)
 		smooth_corners_surface(surface, SDL_MapRGBA(surface->format, 0, 0, 0, 0), &rect, cornerRadius);
 	}
 
-	TTF_Font *font = TTF_OpenFont(config->keyboardFont.c_str(), config->keyboardFontSize);
+	TTF_Font *font = FontManager::get(config->keyboardFont, config->keyboardFontSize);
+	if (!font) {
+		SDL_FreeSurface(surface);
+		return -1;
+	}
 	SDL_Surface *textSurface;
 	SDL_Color textColor = { foregroundColor.r, foregroundColor.g, foregroundColor.b, foregroundColor.a };
 	textSurface = TTF_RenderText_Blended(font, text.c_str(), textColor);
@@ -93,7 +100,6 @@ int Tooltip::init(SDL_Renderer *renderer, const std::string &text)
 
 	texture = SDL_CreateTextureFromSurface(renderer, surface);
 
-	TTF_CloseFont(font);
 	SDL_FreeSurface(textSurface);
 	SDL_FreeSurface(surface);
 
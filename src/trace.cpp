@@ -0,0 +1,116 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include <fstream>
+#include <map>
+#include <unistd.h>
+#include <vector>
+
+struct TraceSpan {
+	const char *name;
+	SDL_threadID thread;
+	Uint64 start;
+	Uint64 end;
+};
+
+SDL_atomic_t Trace::enabled = {};
+
+static SDL_mutex *traceMutex = nullptr;
+static std::string tracePath;
+static Uint64 traceStart = 0;
+static std::vector<TraceSpan> spans;
+static std::map<SDL_threadID, const char *> threadNames;
+
+int Trace::start(const std::string &path)
+{
+	if (isEnabled()) {
+		return 0;
+	}
+	traceMutex = SDL_CreateMutex();
+	if (!traceMutex) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to create trace mutex: %s", SDL_GetError());
+		return 1;
+	}
+	tracePath = path;
+	traceStart = SDL_GetPerformanceCounter();
+	spans.reserve(4096);
+	SDL_AtomicSet(&enabled, 1);
+	return 0;
+}
+
+void Trace::setThreadName(const char *name)
+{
+	if (!isEnabled()) {
+		return;
+	}
+	SDL_LockMutex(traceMutex);
+	threadNames[SDL_ThreadID()] = name;
+	SDL_UnlockMutex(traceMutex);
+}
+
+void Trace::addSpan(const char *name, Uint64 start, Uint64 end)
+{
+	if (!isEnabled()) {
+		return;
+	}
+	SDL_LockMutex(traceMutex);
+	// Recording may have stopped in the meantime
+	if (isEnabled()) {
+		spans.push_back({ name, SDL_ThreadID(), start, end });
+	}
+	SDL_UnlockMutex(traceMutex);
+}
+
+void Trace::stop()
+{
+	if (!isEnabled()) {
+		return;
+	}
+	// Spans that are still open on other threads when this runs are dropped
+	SDL_LockMutex(traceMutex);
+	SDL_AtomicSet(&enabled, 0);
+
+	double frequency = static_cast<double>(SDL_GetPerformanceFrequency()) / 1000000.0;
+	int pid = getpid();
+	std::ofstream os(tracePath, std::ofstream::trunc);
+	os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":0,\"args\":{\"name\":\"osk-sdl\"}}";
+	for (const auto &thread : threadNames) {
+		os << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread.first
+		   << ",\"args\":{\"name\":\"" << thread.second << "\"}}";
+	}
+	os.setf(std::ios::fixed);
+	os.precision(3);
+	for (const auto &span : spans) {
+		os << ",\n{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << span.thread
+		   << ",\"ts\":" << static_cast<double>(span.start - traceStart) / frequency
+		   << ",\"dur\":" << static_cast<double>(span.end - span.start) / frequency << "}";
+	}
+	os << "\n]}\n";
+	os.close();
+	if (!os) {
+		SDL_LogError(SDL_LOG_CATEGORY_SYSTEM, "Unable to write trace to %s", tracePath.c_str());
+	} else {
+		SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "Wrote %zu trace spans to %s", spans.size(), tracePath.c_str());
+	}
+	spans.clear();
+	threadNames.clear();
+	SDL_UnlockMutex(traceMutex);
+}
@@ -0,0 +1,107 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+#include <SDL2/SDL.h>
+#include <string>
+
+/*
+ * Records timed spans from any thread and writes them as Chrome trace-event JSON, which can be opened in
+ * chrome://tracing or Perfetto. While no trace is being recorded, a span costs a single atomic read.
+ */
+class Trace {
+public:
+	/**
+	  Start recording
+	  @param path File to write the trace to when recording stops
+	  @return 0 on success, non-zero on error
+	  */
+	static int start(const std::string &path);
+	/**
+	  Stop recording and write the trace file. Does nothing if no trace is being recorded.
+	  */
+	static void stop();
+	/**
+	  Query whether a trace is being recorded
+	  @return true if spans are recorded, false otherwise
+	  */
+	static bool isEnabled() { return SDL_AtomicGet(&enabled) != 0; };
+	/**
+	  Name the calling thread in the trace
+	  @param name Thread name, must stay valid until the trace is written
+	  */
+	static void setThreadName(const char *name);
+	/**
+	  Record a finished span on the calling thread
+	  @param name Span name, must stay valid until the trace is written
+	  @param start Performance counter value at the start of the span
+	  @param end Performance counter value at the end of the span
+	  */
+	static void addSpan(const char *name, Uint64 start, Uint64 end);
+
+private:
+	static SDL_atomic_t enabled;
+};
+
+/*
+ * Records a span from construction until the end of the enclosing scope
+ */
+class TraceScope {
+public:
+	/**
+	  Constructor
+	  @param name Span name, must stay valid until the trace is written
+	  */
+	explicit TraceScope(const char *name)
+		: name(name)
+		, start(Trace::isEnabled() ? SDL_GetPerformanceCounter() : 0)
+	{
+	}
+	~TraceScope()
+	{
+		if (start) {
+			Trace::addSpan(name, start, SDL_GetPerformanceCounter());
+		}
+	}
+	TraceScope(const TraceScope &) = delete;
+	TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+	const char *name;
+	Uint64 start;
+};
+
+/**
+  Call a function and record a span for the duration of the call
+  @param name Span name, must stay valid until the trace is written
+  @param f Function to call
+  @return Return value of f
+  */
+template <typename F>
+auto traceCall(const char *name, F &&f)
+{
+	TraceScope scope(name);
+	return f();
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#endif
@@ -19,9 +19,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "util.h"
 #include "draw_helpers.h"
+#include "fontmanager.h"
 #include <errno.h>
 #include <getopt.h>
-#include <numeric>
+
+// Values for long options without a short equivalent
+enum {
+	OPT_TRACE = 256,
+	OPT_TUNE_KDF,
+};
+
+// Longest unlock time --tune-kdf accepts, in ms
+constexpr unsigned long TUNE_KDF_MAX_MS = 60 * 1000;
 
 int fetchOpts(int argc, char **args, Opts *opts)
 {
@@ -34,21 +43,21 @@ int fetchOpts(int argc, char **args, Opts *opts)
 		{ "no-gles", no_argument, 0, 'G' },
 		{ "version", no_argument, 0, 'V' },
 		{ "no-keyboard", no_argument, 0, 'x' },
+		{ "trace", required_argument, 0, OPT_TRACE },
+		{ "tune-kdf", required_argument, 0, OPT_TUNE_KDF },
 		{ 0, 0, 0, 0 }
 	};
 
 	while ((opt = getopt_long(argc, args, "td:n:c:o:kvGVx", longOpts, &optIndex)) != -1)
 		switch (opt) {
 		case 't':
-			opts->luksDevPath = DEFAULT_LUKSDEVPATH;
-			opts->luksDevName = DEFAULT_LUKSDEVNAME;
 			opts->testMode = true;
 			break;
 		case 'd':
-			opts->luksDevPath = optarg;
+			opts->luksDevPaths.emplace_back(optarg);
 			break;
 		case 'n':
-			opts->luksDevName = optarg;
+			opts->luksDevNames.emplace_back(optarg);
 			break;
 		case 'c':
 			opts->confPath = optarg;
@@ -68,41 +77,53 @@ int fetchOpts(int argc, char **args, Opts *opts)
 		case 'G':
 			opts->noGLES = true;
 			break;
+		case OPT_TRACE:
+			opts->tracePath = optarg;
+			break;
+		case OPT_TUNE_KDF: {
+			// strtoul skips whitespace and wraps negative numbers around, so only digits are let through to it
+			char *end = nullptr;
+			errno = 0;
+			unsigned long ms = 0;
+			if (optarg[0] >= '0' && optarg[0] <= '9') {
+				ms = std::strtoul(optarg, &end, 10);
+			}
+			if (ms == 0 || *end != '\0' || errno == ERANGE || ms > TUNE_KDF_MAX_MS) {
+				SDL_LogError(SDL_LOG_CATEGORY_ERROR, "--tune-kdf needs a time in ms, from 1 to %lu", TUNE_KDF_MAX_MS);
+				return 1;
+			}
+			opts->tuneKdfMs = static_cast<unsigned>(ms);
+			break;
+		}
 		case 'V':
 			SDL_Log("osk-sdl v%s", VERSION);
 			exit(0);
 		default:
-			SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Usage: osk-sdl [-t|--testmode] [-k|--keyscript] [-d /dev/sda] [-n device_name] "
+			SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Usage: osk-sdl [-t|--testmode] [-k|--keyscript] [-d /dev/sda -n device_name]... "
 												 "[-c /etc/osk.conf] [-o /boot/osk.conf] "
-												 "[-v|--verbose] [-G|--no-gles] [-x|--no-keyboard");
+												 "[-v|--verbose] [-G|--no-gles] [-x|--no-keyboard] "
+												 "[--trace trace.json] [--tune-kdf ms]");
 			return 1;
 		}
-	if (opts->luksDevPath.empty()) {
-		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "No device path specified, use -d [path] or -t");
-		return 1;
+	if (opts->testMode && opts->luksDevPaths.empty() && opts->luksDevNames.empty()) {
+		opts->luksDevPaths.emplace_back(DEFAULT_LUKSDEVPATH);
+		opts->luksDevNames.emplace_back(DEFAULT_LUKSDEVNAME);
 	}
-	if (opts->luksDevName.empty()) {
+	// Devices may also come from the config file, which is read later
+	if (opts->luksDevPaths.size() > opts->luksDevNames.size()) {
 		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "No device name specified, use -n [name] or -t");
 		return 1;
 	}
+	if (opts->luksDevPaths.size() < opts->luksDevNames.size()) {
+		SDL_LogError(SDL_LOG_CATEGORY_ERROR, "No device path specified, use -d [path] or -t");
+		return 1;
+	}
 	if (opts->confPath.empty()) {
 		opts->confPath = DEFAULT_CONFPATH;
 	}
 	return 0;
 }
 
-std::string strVector2str(const std::vector<std::string> &strVector)
-{
-	const auto strLength = std::accumulate(strVector.begin(), strVector.end(), size_t {},
-		[](auto acc, const auto &s) { return acc + s.size(); });
-	std::string result;
-	result.reserve(strLength);
-	for (const auto &str : strVector) {
-		result.append(str);
-	}
-	return result;
-}
-
 int find_gles_driver_index()
 {
 	int render_driver_count = SDL_GetNumRenderDrivers();
@@ -147,7 +168,10 @@ void draw_dot_glyph(SDL_Renderer *renderer, SDL_Point center, int size, Config *
 	// Cache a new texture if needed
 	if (!dotGlyph) {
 		SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Caching a new glyph texture with size %i", size);
-		TTF_Font *font = TTF_OpenFont(config->keyboardFont.c_str(), size);
+		TTF_Font *font = FontManager::get(config->keyboardFont, size);
+		if (!font) {
+			return;
+		}
 		SDL_Color textColor = { config->inputBoxForeground.r, config->inputBoxForeground.g, config->inputBoxForeground.b, config->inputBoxForeground.a };
 		SDL_Surface *textSurface = TTF_RenderUTF8_Blended(font, config->inputBoxDotGlyph.c_str(), textColor);
 
@@ -200,79 +224,76 @@ void draw_password_box_dots(SDL_Renderer *renderer, Config *config, const SDL_Re
 		SDL_RenderSetClipRect(renderer, nullptr); // Reset clip rect
 }
 
-bool handleVirtualKeyPress(const std::string &tapped, Keyboard &kbd, LuksDevice &lkd,
-	std::vector<std::string> &passphrase, bool keyscript)
+bool handleVirtualKeyPress(const touchArea &tapped, Keyboard &kbd, LuksDeviceGroup &lkd,
+	Passphrase &passphrase, bool keyscript, bool &passphraseTooLong)
 {
-	// return pressed
-	if (tapped == "\n") {
-		std::string pass = strVector2str(passphrase);
-		lkd.setPassphrase(pass);
+	switch (tapped.action) {
+	case KeyAction::ret:
+		lkd.setPassphrase(passphrase);
 		if (keyscript) {
 			return true;
 		}
 		lkd.unlock();
-	}
-	// Backspace pressed
-	else if (tapped == KEYCAP_BACKSPACE) {
-		if (!passphrase.empty()) {
-			passphrase.pop_back();
-		}
-	}
-	// Shift pressed
-	else if (tapped == KEYCAP_SHIFT) {
+		break;
+	case KeyAction::backspace:
+		passphrase.pop();
+		break;
+	case KeyAction::shift:
 		if (kbd.getActiveLayer() > 1) {
 			kbd.setActiveLayer(0);
 		} else {
 			kbd.setActiveLayer(!kbd.getActiveLayer());
 		}
-	}
-	// Numbers key pressed:
-	else if (tapped == KEYCAP_NUMBERS) {
+		break;
+	case KeyAction::numbers:
 		kbd.setActiveLayer(2);
-	}
-	// Symbols key pressed
-	else if (tapped == KEYCAP_SYMBOLS) {
+		break;
+	case KeyAction::symbols:
 		kbd.setActiveLayer(3);
-	}
-	// ABC key was pressed
-	else if (tapped == KEYCAP_ABC) {
+		break;
+	case KeyAction::abc:
 		kbd.setActiveLayer(0);
-	}
-	// handle other key presses
-	else if (!tapped.empty()) {
-		passphrase.push_back(tapped);
+		break;
+	case KeyAction::character:
+		if (!passphrase.append(kbd.getKeyText(tapped))) {
+			passphraseTooLong = true;
+		}
+		break;
 	}
 	return false;
 }
 
-void handleTapBegin(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd)
+void handleTapBegin(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, int64_t pointerId)
 {
 	int offsetYTapped = yTapped - static_cast<int>(screenHeight - (kbd.getHeight() * kbd.getPosition()));
-	touchArea key = kbd.getKeyForCoordinates(xTapped, offsetYTapped);
-	kbd.setHighlightedKey(key);
 	// only rumble if an actual key was tapped
-	if (!key.keyChar.empty())
+	if (kbd.pressKey(pointerId, kbd.getKeyForCoordinates(xTapped, offsetYTapped)))
 		kbd.hapticRumble();
 }
 
-void handleTapEnd(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, Toggle &kbdToggle, LuksDevice &lkd, std::vector<std::string> &passphrase, bool keyscript, bool &showPasswordError, bool &done)
+bool handleTapMove(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, int64_t pointerId)
+{
+	int offsetYTapped = yTapped - static_cast<int>(screenHeight - (kbd.getHeight() * kbd.getPosition()));
+	return kbd.moveKey(pointerId, kbd.getKeyForCoordinates(xTapped, offsetYTapped));
+}
+
+void handleTapEnd(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, Toggle &kbdToggle, LuksDeviceGroup &lkd, Passphrase &passphrase, bool keyscript, bool &showPasswordError, bool &passphraseTooLong, bool &done, int64_t pointerId)
 {
 	showPasswordError = false;
+	passphraseTooLong = false;
 	int offsetYTapped = yTapped - static_cast<int>(screenHeight - (kbd.getHeight() * kbd.getPosition()));
 
 	if (!kbdToggle.isVisible()) {
-		/* handle tap on osk */
-		touchArea key = kbd.getKeyForCoordinates(xTapped, offsetYTapped);
-		touchArea highlightedKey = kbd.getHighlightedKey();
-
-		kbd.unsetHighlightedKey();
-		if (key.x1 != highlightedKey.x1 || key.y1 != highlightedKey.y1) {
-			return;
-		}
-		std::string tapped = key.keyChar;
-		if (!lkd.unlockRunning()) {
-			done = handleVirtualKeyPress(tapped, kbd, lkd, passphrase, keyscript);
+		/* handle tap on osk, lifting the finger off the keyboard cancels the press */
+		kbd.releaseKey(pointerId, kbd.getKeyForCoordinates(xTapped, offsetYTapped));
+		// Overlapping presses are committed in the order they started
+		const touchArea *key;
+		while (!done && (key = kbd.popCommittedKey())) {
+			if (!lkd.unlockRunning()) {
+				done = handleVirtualKeyPress(*key, kbd, lkd, passphrase, keyscript, passphraseTooLong);
+			}
 		}
+		showPasswordError = passphraseTooLong;
 	} else if (kbdToggle.isTapped(xTapped, yTapped)) {
 		/* disable toggle so osk shows up */
 		kbdToggle.setVisible(false);
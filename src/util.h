@@ -21,7 +21,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define UTIL_H
 #include "config.h"
 #include "keyboard.h"
-#include "luksdevice.h"
+#include "luksdevicegroup.h"
+#include "passphrase.h"
 #include "toggle.h"
 #include <SDL2/SDL.h>
 #include <cmath>
@@ -31,16 +32,19 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <filesystem>
 #include <fcntl.h>
 #include <linux/input.h>
+#include <vector>
 
 constexpr char DEFAULT_LUKSDEVPATH[] = "/home/user/disk";
 constexpr char DEFAULT_LUKSDEVNAME[] = "root";
 constexpr char DEFAULT_CONFPATH[] = "/etc/osk.conf";
 
 struct Opts {
-	std::string luksDevPath;
-	std::string luksDevName;
+	std::vector<std::string> luksDevPaths;
+	std::vector<std::string> luksDevNames;
 	std::string confPath;
 	std::string confOverridePath;
+	std::string tracePath;
+	unsigned tuneKdfMs;
 	bool testMode;
 	bool verbose;
 	bool keyscript;
@@ -57,13 +61,6 @@ struct Opts {
  */
 int fetchOpts(int argc, char **args, Opts *opts);
 
-/**
-  Convert vector of strings into a single string
-  @param strVector Vector of strings
-  @return String with all elements of strVector concatenated together
- */
-std::string strVector2str(const std::vector<std::string> &strVector);
-
 /**
   Return the index of the OpenGL ES driver
   @return The driver's index or -1 (the default driver) when no OpenGL ES driver can be found
@@ -81,15 +78,16 @@ void draw_dot_glyph(SDL_Renderer *renderer, SDL_Point center, int size, Config *
 
 /**
   Handle keypresses for virtual keyboard
-  @param tapped Character tapped on keyboard
+  @param tapped Key tapped on keyboard
   @param kbd Initialized Keyboard obj
-  @param lkd Initialized LuksDevice obj
-  @param lkd passphrase Passphrase to modify
+  @param lkd Initialized LuksDeviceGroup obj
+  @param passphrase Passphrase to modify
   @param keyscript Whether we're in keyscript mode
+  @param passphraseTooLong Will be set to true if the key was refused because the passphrase is full
   @return Whether we're done with the main loop
  */
-bool handleVirtualKeyPress(const std::string &tapped, Keyboard &kbd, LuksDevice &lkd,
-	std::vector<std::string> &passphrase, bool keyscript);
+bool handleVirtualKeyPress(const touchArea &tapped, Keyboard &kbd, LuksDeviceGroup &lkd,
+	Passphrase &passphrase, bool keyscript, bool &passphraseTooLong);
 
 /**
   Draw the dots to represent hidden characters
@@ -106,8 +104,20 @@ void draw_password_box_dots(SDL_Renderer *renderer, Config *config, const SDL_Re
   @param yTapped Y coordinate of the tap
   @param screenHeight Height of overall screen
   @param kbd Initialized Keyboard obj
+  @param pointerId Finger ID of the touch, or MOUSE_POINTER_ID
+ */
+void handleTapBegin(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, int64_t pointerId);
+
+/**
+  Handle a finger motion event
+  @param xTapped X coordinate of the finger
+  @param yTapped Y coordinate of the finger
+  @param screenHeight Height of overall screen
+  @param kbd Initialized Keyboard obj
+  @param pointerId Finger ID of the touch
+  @return Whether the finger moved to another key, so the highlight changed
  */
-void handleTapBegin(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd);
+bool handleTapMove(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, int64_t pointerId);
 
 /**
   Handle a finger or mouse up event
@@ -115,13 +125,16 @@ void handleTapBegin(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboa
   @param yTapped Y coordinate of the tap
   @param screenHeight Height of overall screen
   @param kbd Initialized Keyboard obj
-  @param lkd Initialized LuksDevice obj
+  @param lkd Initialized LuksDeviceGroup obj
   @param passphrase The current passphrase
   @param keyscript Whether we're in keyscript mode
   @param showPasswordError Will be set to true if a password error should be shown, false otherwise
+  @param passphraseTooLong Will be set to true if a key was refused because the passphrase is full, false
+  otherwise. showPasswordError is set along with it.
   @param done Will be set to true if the device was unlocked, false otherwise
+  @param pointerId Finger ID of the touch, or MOUSE_POINTER_ID
  */
-void handleTapEnd(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, Toggle &kbdToggle, LuksDevice &lkd, std::vector<std::string> &passphrase, bool keyscript, bool &showPasswordError, bool &done);
+void handleTapEnd(unsigned xTapped, unsigned yTapped, int screenHeight, Keyboard &kbd, Toggle &kbdToggle, LuksDeviceGroup &lkd, Passphrase &passphrase, bool keyscript, bool &showPasswordError, bool &passphraseTooLong, bool &done, int64_t pointerId);
 
 /**
   Rumble a haptic device for the given duration
@@ -0,0 +1,143 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "workerpool.h"
+#include "trace.h"
+
+WorkerPool::WorkerPool(int threadCount)
+{
+	SDL_AtomicSet(&nextIndex, 0);
+	if (threadCount < 1) {
+		return;
+	}
+
+	mutex = SDL_CreateMutex();
+	jobQueued = SDL_CreateCond();
+	jobsDone = SDL_CreateCond();
+	if (!mutex || !jobQueued || !jobsDone) {
+		SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to create worker pool, running jobs serially: %s",
+			SDL_GetError());
+		return;
+	}
+
+	for (int i = 0; i < threadCount; i++) {
+		SDL_Thread *thread = SDL_CreateThread(worker, "osk_worker", this);
+		if (!thread) {
+			SDL_LogWarn(SDL_LOG_CATEGORY_SYSTEM, "Unable to start worker thread: %s", SDL_GetError());
+			break;
+		}
+		threads.push_back(thread);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	if (!threads.empty()) {
+		SDL_LockMutex(mutex);
+		stopping = true;
+		jobs.clear();
+		SDL_CondBroadcast(jobQueued);
+		SDL_UnlockMutex(mutex);
+		for (auto *thread : threads) {
+			SDL_WaitThread(thread, nullptr);
+		}
+	}
+	if (jobsDone)
+		SDL_DestroyCond(jobsDone);
+	if (jobQueued)
+		SDL_DestroyCond(jobQueued);
+	if (mutex)
+		SDL_DestroyMutex(mutex);
+}
+
+void WorkerPool::submit(std::function<void(int)> job)
+{
+	if (threads.empty()) {
+		job(0);
+		return;
+	}
+	SDL_LockMutex(mutex);
+	jobs.push_back(std::move(job));
+	pending++;
+	SDL_CondSignal(jobQueued);
+	SDL_UnlockMutex(mutex);
+}
+
+void WorkerPool::wait()
+{
+	if (threads.empty()) {
+		return;
+	}
+	SDL_LockMutex(mutex);
+	while (pending > 0) {
+		SDL_CondWait(jobsDone, mutex);
+	}
+	SDL_UnlockMutex(mutex);
+}
+
+void WorkerPool::waitFor(SDL_atomic_t &counter)
+{
+	if (threads.empty()) {
+		return;
+	}
+	SDL_LockMutex(mutex);
+	// Jobs change the counter before the worker takes the mutex to signal that they are done, so no update is missed
+	while (SDL_AtomicGet(&counter) > 0) {
+		SDL_CondWait(jobsDone, mutex);
+	}
+	SDL_UnlockMutex(mutex);
+}
+
+int WorkerPool::defaultThreadCount(int max)
+{
+	int cpus = SDL_GetCPUCount();
+	if (cpus <= 1) {
+		return 0;
+	}
+	return cpus < max ? cpus : max;
+}
+
+int WorkerPool::worker(void *data)
+{
+	const auto pool = static_cast<WorkerPool *>(data);
+	const int index = SDL_AtomicAdd(&pool->nextIndex, 1);
+	Trace::setThreadName("osk_worker");
+
+	SDL_LockMutex(pool->mutex);
+	while (true) {
+		while (pool->jobs.empty() && !pool->stopping) {
+			SDL_CondWait(pool->jobQueued, pool->mutex);
+		}
+		if (pool->stopping) {
+			break;
+		}
+		auto job = std::move(pool->jobs.front());
+		pool->jobs.pop_front();
+		SDL_UnlockMutex(pool->mutex);
+
+		job(index);
+
+		SDL_LockMutex(pool->mutex);
+		// Every job may be the last one somebody in waitFor() is waiting for
+		pool->pending--;
+		SDL_CondBroadcast(pool->jobsDone);
+	}
+	SDL_UnlockMutex(pool->mutex);
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_thread.h>
+#include <deque>
+#include <functional>
+#include <vector>
+
+class WorkerPool {
+public:
+	/**
+	  Constructor
+	  @param threads Number of worker threads to start. With 0 threads, jobs are run on the calling thread
+	  when they are submitted.
+	  */
+	explicit WorkerPool(int threads);
+	/**
+	  Discard queued jobs that have not started yet, wait for running ones and stop the worker threads
+	  */
+	~WorkerPool();
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool &operator=(const WorkerPool &) = delete;
+	/**
+	  Queue a job for execution
+	  @param job Function to run, it is passed the index of the worker running it (0 to size() - 1)
+	  */
+	void submit(std::function<void(int)> job);
+	/**
+	  Block until all queued jobs have finished
+	  */
+	void wait();
+	/**
+	  Block until a counter that jobs decrement before they return drops to 0, without waiting for other jobs
+	  @param counter Counter to watch
+	  */
+	void waitFor(SDL_atomic_t &counter);
+	/**
+	  Get the number of distinct worker indexes jobs may be passed
+	  @return Number of worker threads, or 1 if jobs run on the calling thread
+	  */
+	int size() const { return threads.empty() ? 1 : static_cast<int>(threads.size()); };
+	/**
+	  Get a sensible number of threads for CPU bound work on this machine
+	  @param max Upper limit for the number of threads
+	  @return Number of threads, 0 if there is only one CPU
+	  */
+	static int defaultThreadCount(int max);
+
+private:
+	std::deque<std::function<void(int)>> jobs;
+	std::vector<SDL_Thread *> threads;
+	SDL_mutex *mutex = nullptr;
+	SDL_cond *jobQueued = nullptr;
+	SDL_cond *jobsDone = nullptr;
+	SDL_atomic_t nextIndex;
+	int pending = 0;
+	bool stopping = false;
+
+	/**
+	  Worker thread main loop
+	  @param data WorkerPool object to use, should represent 'this'
+	  */
+	static int worker(void *data);
+};
+#endif
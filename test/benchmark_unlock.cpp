@@ -0,0 +1,203 @@
+/*
+Copyright (C) 2021 Clayton Craft <clayton@craftyguy.net>
+
+This file is part of osk-sdl.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how long unlocking takes, phase by phase, without root: the device is only checked against the
+ * passphrase, no decrypted device is created. Run with "meson test --benchmark" or on its own:
+ *   benchmark-unlock <image> [runs] [results.json]
+ * The image is created if it doesn't exist. The passphrase is taken from $OSK_SDL_BENCH_PASSPHRASE.
+ */
+
+#include "luksdevice.h"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+constexpr char DEFAULT_PASSPHRASE[] = "postmarketOS";
+constexpr int DEFAULT_RUNS = 10;
+constexpr size_t IMAGE_SIZE = 20 * 1024 * 1024;
+// KDF time of a created image, long enough to dominate the other phases like on a real device
+constexpr uint32_t IMAGE_KDF_MS = 200;
+
+struct Phase {
+	const char *name;
+	std::vector<double> samples;
+
+	double mean() const
+	{
+		double sum = 0;
+		for (double sample : samples) {
+			sum += sample;
+		}
+		return samples.empty() ? 0 : sum / samples.size();
+	}
+
+	double median() const
+	{
+		if (samples.empty()) {
+			return 0;
+		}
+		std::vector<double> sorted = samples;
+		std::sort(sorted.begin(), sorted.end());
+		size_t middle = sorted.size() / 2;
+		return sorted.size() % 2 ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+	}
+
+	double stddev() const
+	{
+		if (samples.size() < 2) {
+			return 0;
+		}
+		double m = mean();
+		double sum = 0;
+		for (double sample : samples) {
+			sum += (sample - m) * (sample - m);
+		}
+		return std::sqrt(sum / (samples.size() - 1));
+	}
+};
+
+static int createImage(const std::string &path, const std::string &passphrase)
+{
+	std::ofstream os(path, std::ofstream::binary | std::ofstream::trunc);
+	os.seekp(IMAGE_SIZE - 1);
+	os.put(0);
+	os.close();
+	if (!os) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to create %s", path.c_str());
+		return 1;
+	}
+
+	struct crypt_device *cd = nullptr;
+	int ret = crypt_init(&cd, path.c_str());
+	if (ret < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "crypt_init() failed for %s", path.c_str());
+		return 1;
+	}
+	struct crypt_pbkdf_type pbkdf = {};
+	pbkdf.type = CRYPT_KDF_ARGON2ID;
+	pbkdf.hash = "sha256";
+	pbkdf.time_ms = IMAGE_KDF_MS;
+	pbkdf.max_memory_kb = 64 * 1024;
+	pbkdf.parallel_threads = 1;
+	ret = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (ret >= 0) {
+		ret = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", nullptr, nullptr, 64, nullptr);
+	}
+	if (ret >= 0) {
+		ret = crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, nullptr, 0, passphrase.c_str(),
+			passphrase.size());
+	}
+	crypt_free(cd);
+	if (ret < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to format %s: %d", path.c_str(), ret);
+		unlink(path.c_str());
+		return 1;
+	}
+	SDL_Log("Created %s", path.c_str());
+	return 0;
+}
+
+static void writeJson(const std::string &path, const std::string &image, const std::vector<Phase> &phases)
+{
+	std::ofstream os(path, std::ofstream::trunc);
+	os << "{\n\t\"image\": \"" << image << "\",\n\t\"runs\": " << phases.front().samples.size()
+	   << ",\n\t\"unit\": \"ms\",\n\t\"phases\": {";
+	for (size_t i = 0; i < phases.size(); i++) {
+		const Phase &phase = phases[i];
+		os << (i ? "," : "") << "\n\t\t\"" << phase.name << "\": {\"mean\": " << phase.mean()
+		   << ", \"median\": " << phase.median() << ", \"stddev\": " << phase.stddev() << ", \"samples\": [";
+		for (size_t j = 0; j < phase.samples.size(); j++) {
+			os << (j ? ", " : "") << phase.samples[j];
+		}
+		os << "]}";
+	}
+	os << "\n\t}\n}\n";
+	os.close();
+	if (!os) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", path.c_str());
+	}
+}
+
+int main(int argc, char **args)
+{
+	if (argc < 2) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Usage: benchmark-unlock <image> [runs] [results.json]");
+		return 1;
+	}
+	std::string image = args[1];
+	int runs = argc > 2 ? std::max(1, std::atoi(args[2])) : DEFAULT_RUNS;
+	std::string jsonPath = argc > 3 ? args[3] : "";
+	const char *envPassphrase = getenv("OSK_SDL_BENCH_PASSPHRASE");
+	std::string passphrase = envPassphrase ? envPassphrase : DEFAULT_PASSPHRASE;
+	Passphrase lockedPassphrase;
+	lockedPassphrase.append(passphrase);
+	std::string name = "osk-sdl-benchmark";
+
+	struct stat st;
+	if (stat(image.c_str(), &st) != 0 && createImage(image, passphrase) != 0) {
+		return 1;
+	}
+	if (SDL_Init(SDL_INIT_EVENTS) < 0) {
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "SDL_Init failed: %s", SDL_GetError());
+		return 1;
+	}
+	Uint32 eventType = SDL_RegisterEvents(1);
+
+	std::vector<Phase> phases = { { "init", {} }, { "load", {} }, { "kdf", {} }, { "total", {} } };
+	for (int run = 0; run < runs; run++) {
+		// A new device every run, so that the header is read again
+		LuksDevice device(name, image, eventType);
+		device.setVerifyOnly(true);
+		device.setPassphrase(lockedPassphrase);
+		if (device.unlock() != 0) {
+			SDL_Quit();
+			return 1;
+		}
+		SDL_Event event;
+		while (SDL_WaitEvent(&event) && event.type != eventType) {
+		}
+		if (event.user.code < 0) {
+			SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Run %d failed: %d", run, event.user.code);
+			SDL_Quit();
+			return 1;
+		}
+		const UnlockTimings &timings = device.getTimings();
+		phases[0].samples.push_back(timings.init);
+		phases[1].samples.push_back(timings.load);
+		phases[2].samples.push_back(timings.kdf);
+		phases[3].samples.push_back(timings.init + timings.load + timings.kdf);
+	}
+
+	for (const auto &phase : phases) {
+		SDL_Log("%-6s mean %8.2f ms, median %8.2f ms, stddev %8.2f ms", phase.name, phase.mean(), phase.median(),
+			phase.stddev());
+	}
+	if (!jsonPath.empty()) {
+		writeJson(jsonPath, image, phases);
+	}
+	SDL_Quit();
+	return 0;
+}
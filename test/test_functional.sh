@@ -207,6 +207,99 @@ test_keyscript_mouse_toggle_osk() {
 	check_result "$result_file" "$expected"
 }
 
+###########################################################
+# Test key script (-k) with replayed evdev touch input
+###########################################################
+# Writes a recording of multi-touch taps, for replay through evdev-devices
+# $1: recording file to write
+# $2...: one tap per argument, "<slot> <x> <y> <touch time> <lift time>", times in seconds
+record_evdev_taps() {
+	python3 - "$@" <<-EOF
+		import struct, sys
+		EV_SYN, EV_ABS = 0, 3
+		ABS_MT_SLOT, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_TRACKING_ID = 0x2f, 0x35, 0x36, 0x39
+		# Nothing happens for the first 3 seconds, while osk-sdl starts up
+		reports = [(0, [(EV_SYN, 0, 0)])]
+		def report(t, slot, *events):
+		    reports.append((t, [(EV_ABS, ABS_MT_SLOT, slot), *events, (EV_SYN, 0, 0)]))
+		for i, tap in enumerate(sys.argv[2:]):
+		    slot, x, y, down, up = tap.split()
+		    report(float(down), int(slot), (EV_ABS, ABS_MT_TRACKING_ID, i), (EV_ABS, ABS_MT_POSITION_X, int(x)),
+		        (EV_ABS, ABS_MT_POSITION_Y, int(y)))
+		    report(float(up), int(slot), (EV_ABS, ABS_MT_TRACKING_ID, -1))
+		with open(sys.argv[1], "wb") as recording:
+		    for t, events in sorted(reports, key=lambda r: r[0]):
+		        for type, code, value in events:
+		            recording.write(struct.pack("llHHi", int(t), round(t % 1 * 1000000), type, code, value))
+	EOF
+}
+
+# Replays taps on the keys of mouse_click_qwerty, and checks that 'qwerty' was typed
+# $1: name of the test, used for its temporary files
+# $2...: taps, as for record_evdev_taps
+# returns: 0 on match, 1 on mismatch
+check_evdev_replay_qwerty() {
+	local name="$1"
+	shift
+	local expected="qwerty"
+	local result_file="/tmp/osk_sdl_test_${name}_$DISPLAY"
+	local recording="/tmp/osk_sdl_test_${name}_$DISPLAY.events"
+	local conf_override="/tmp/osk_sdl_test_${name}_$DISPLAY.conf"
+	local osk_pid
+	local retval=0
+
+	record_evdev_taps "$recording" "$@"
+	echo "evdev-devices = $recording" > "$conf_override"
+
+	osk_pid="$(run_osk_sdl false "$result_file" "-k -n test_disk -d test/luks.disk -o $conf_override")"
+	sleep 7
+	kill -9 "$osk_pid" 2>/dev/null || true
+
+	# check result
+	check_result "$result_file" "$expected" || retval=1
+	rm -f "$recording" "$conf_override" || true
+	return $retval
+}
+
+test_keyscript_evdev_replay() {
+	if ! command -v python3 >/dev/null; then
+		echo "This test requires python3, skipping."
+		exit 77
+	fi
+
+	echo "** Testing key script with replayed evdev touch input"
+	# Two fingers take turns, each one is lifted after the other one touched the next key
+	# *** NOTE: Depends on screen size being 480x800 !
+	check_evdev_replay_qwerty keyscript_evdev_replay \
+		"0 21 575 3.0 3.3" \
+		"1 70 575 3.2 3.5" \
+		"0 130 575 3.4 3.7" \
+		"1 185 575 3.6 3.9" \
+		"0 225 575 3.8 4.1" \
+		"1 270 575 4.0 4.3" \
+		"0 430 775 4.2 4.5"
+}
+
+test_keyscript_evdev_replay_reversed_lift() {
+	if ! command -v python3 >/dev/null; then
+		echo "This test requires python3, skipping."
+		exit 77
+	fi
+
+	echo "** Testing key script with replayed evdev touch input, lifting fingers in reverse order"
+	# The second finger of each pair is lifted before the first one, keys are still typed in the order they
+	# were touched
+	# *** NOTE: Depends on screen size being 480x800 !
+	check_evdev_replay_qwerty keyscript_evdev_replay_reversed_lift \
+		"0 21 575 3.0 3.5" \
+		"1 70 575 3.2 3.3" \
+		"0 130 575 3.6 4.1" \
+		"1 185 575 3.8 3.9" \
+		"0 225 575 4.2 4.7" \
+		"1 270 575 4.4 4.5" \
+		"0 430 775 4.8 4.9"
+}
+
 ##################################################
 # Test luks unlocking
 ##################################################
@@ -257,6 +350,113 @@ test_luks_phys() {
 	return $retval
 }
 
+##################################################
+# Test cpufreq boost during luks unlocking
+##################################################
+test_luks_cpufreq() {
+	# This test requires a privileged user (root, for devicemapper)
+	if [ "$(whoami)" != "root" ]; then
+		echo "This test requires elevated privileges, skipping."
+		exit 77
+	# CI_JOB_ID is set by gitlab CI
+	elif [ "$CI_JOB_ID" ]; then
+		echo "This test does not work in the gitlab CI, skipping."
+		exit 77
+	fi
+
+	echo "** Testing cpufreq boost during luks unlocking"
+	local test_disk="test/luks.disk"
+	local passphrase="postmarketOS"
+	local result_file="/tmp/osk_sdl_test_luks_cpufreq_$DISPLAY"
+	local sysfs_root="/tmp/osk_sdl_test_sysfs_$DISPLAY"
+	local policy="$sysfs_root/devices/system/cpu/cpufreq/policy0"
+	local conf_override="/tmp/osk_sdl_test_cpufreq_$DISPLAY.conf"
+	local osk_pid
+	local retval=0
+
+	# create a fake cpufreq policy
+	mkdir -p "$policy"
+	echo "schedutil" > "$policy/scaling_governor"
+	echo "powersave schedutil performance" > "$policy/scaling_available_governors"
+	printf "cpufreq-boost = true\ncpufreq-sysfs-root = %s\n" "$sysfs_root" > "$conf_override"
+
+	# create test luks disk
+	qemu-img create -f raw "$test_disk" 20M 1>/dev/null
+	echo "$passphrase" | sudo cryptsetup --iter-time=1 luksFormat "$test_disk"
+
+	# run osk-sdl
+	osk_pid="$(run_osk_sdl true "$result_file" "-v -n osk-sdl-test -d $test_disk -o $conf_override")"
+	sleep 3
+
+	# run test
+	xdotool type --delay 300 "$passphrase"
+	xdotool key Return
+	sleep 3
+	kill -9 "$osk_pid" 2>/dev/null || true
+
+	# check result
+	if ! grep -q "Switched policy0 from governor schedutil to performance" "$result_file"; then
+		echo "ERROR: Governor was not switched!"
+		retval=1
+	elif [ "$(cat "$policy/scaling_governor")" != "schedutil" ]; then
+		echo "ERROR: Governor was not restored!"
+		retval=1
+	else
+		echo "Success!"
+	fi
+
+	# clean up
+	sudo cryptsetup close osk-sdl-test || true
+	rm -rf $test_disk "$sysfs_root" "$conf_override" "$result_file" || true
+
+	return $retval
+}
+
+##################################################
+# Test KDF tuning (--tune-kdf)
+##################################################
+test_tune_kdf() {
+	if ! command -v cryptsetup >/dev/null || ! command -v qemu-img >/dev/null; then
+		echo "This test requires cryptsetup and qemu-img, skipping."
+		exit 77
+	fi
+
+	echo "** Testing KDF tuning"
+	local test_disk="test/luks_tune.disk"
+	local passphrase="postmarketOS"
+	local result_file="/tmp/osk_sdl_test_tune_kdf_$DISPLAY"
+	local retval=0
+
+	# create test luks disk, with a keyslot that is much faster than the target
+	qemu-img create -f raw "$test_disk" 20M 1>/dev/null
+	echo "$passphrase" | cryptsetup --batch-mode --iter-time=1 luksFormat "$test_disk"
+
+	# run test
+	if echo "wrong" | "$OSK_SDL_EXE_PATH" --tune-kdf 200 -d "$test_disk" -n test_disk \
+			-c "$OSK_SDL_CONF_PATH" 2>"$result_file"; then
+		echo "ERROR: Tuning succeeded with a wrong passphrase!"
+		retval=1
+	elif ! echo "$passphrase" | "$OSK_SDL_EXE_PATH" --tune-kdf 200 -d "$test_disk" -n test_disk \
+			-c "$OSK_SDL_CONF_PATH" 2>"$result_file"; then
+		echo "ERROR: Tuning failed!"
+		cat "$result_file"
+		retval=1
+	elif ! grep -q "now takes about 200 ms" "$result_file"; then
+		echo "ERROR: Tuned parameters were not logged!"
+		retval=1
+	elif ! echo "$passphrase" | cryptsetup open --test-passphrase "$test_disk"; then
+		echo "ERROR: Passphrase does not open the tuned keyslot!"
+		retval=1
+	else
+		echo "Success!"
+	fi
+
+	# clean up
+	rm -f "$test_disk" "$result_file" || true
+
+	return $retval
+}
+
 if [ -z "$OSK_SDL_EXE_PATH" ]; then
 	echo "\$OSK_SDL_EXE_PATH must be set to the path of the osk-sdl binary to test"
 	exit 1
@@ -289,6 +489,18 @@ case "$1" in
 	test_keyscript_mouse_toggle_osk)
 		test_keyscript_mouse_toggle_osk
 		;;
+	test_luks_cpufreq)
+		test_luks_cpufreq
+		;;
+	test_tune_kdf)
+		test_tune_kdf
+		;;
+	test_keyscript_evdev_replay)
+		test_keyscript_evdev_replay
+		;;
+	test_keyscript_evdev_replay_reversed_lift)
+		test_keyscript_evdev_replay_reversed_lift
+		;;
 	*)
 		test_keyscript_phys
 		test_keyscript_no_keyboard_phys
@@ -296,5 +508,9 @@ case "$1" in
 		test_keyscript_mouse_symbols
 		test_keyscript_mouse_toggle_osk
 		test_luks_phys
+		test_luks_cpufreq
+		test_tune_kdf
+		test_keyscript_evdev_replay
+		test_keyscript_evdev_replay_reversed_lift
 		;;
 esac